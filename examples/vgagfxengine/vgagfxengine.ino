@@ -301,7 +301,8 @@ static int hscrL0    = 0;
 static int hscrL1    = 0;
 static int hscrincL0 = 1;
 static int hscrincL1 = 2;
-static uint8_t spr_angle[SPRITES_MAX];
+#define NB_SPRITES 32
+static uint8_t spr_angle[NB_SPRITES];
 
  
 void setup() {
@@ -322,8 +323,8 @@ void setup() {
   //vga.begin_audio(8192 /*AUDIO_SAMPLE_BUFFER_SIZE*/, &snd_Mixer);
 
   // Initialize game engine
-  // 2 tiles layers (TILES_MAX_LAYERS)
-  // 32 sprites (SPRITES_MAX)
+  // 2 tiles layers
+  // 32 sprites (up to SPRITES_MAX)
   // 256 tiles + 64 sprites definitions
   // Defaults or change VGA_t4.h:
   // 20x15 tiles of 16x16 pixels in 256 colors 
@@ -347,9 +348,9 @@ void setup() {
   vga.set_hscroll(1, HSCR_BEG,HSCR_END,TILES_W);
 
   // Init sprite animation
-  for (int i=0; i<SPRITES_MAX; i++)
+  for (int i=0; i<NB_SPRITES; i++)
   {
-    spr_angle[i] += (255*i)/SPRITES_MAX;
+    spr_angle[i] += (255*i)/NB_SPRITES;
   }
 
   vga.sprite_data(0, mario, SPRITES_W*SPRITES_H);
@@ -409,7 +410,7 @@ void loop()
   vga.hscroll(1,hscrL1);
   
     
-  for (int i=1; i<SPRITES_MAX; i++)
+  for (int i=1; i<NB_SPRITES; i++)
   {
     spr_angle[i] += 1;
     vga.sprite(i, 150+160*calcco[(spr_angle[i]*360)>>8], 100+120*calcsi[(spr_angle[i]*360)>>8], i);
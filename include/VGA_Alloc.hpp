@@ -0,0 +1,27 @@
+//
+// Placement of the video, audio and engine buffers.
+//
+
+#ifndef VGA_T4_VGA_ALLOC_HPP
+#define VGA_T4_VGA_ALLOC_HPP
+
+#include "VGA_t4.h"
+
+
+enum class vga_region_t {
+  VGA_REGION_HEAP = 0,    // malloc, aligned
+  VGA_REGION_DTCM = 1,    // static arena of ARENA_DTCM_SIZE bytes, fastest for the CPU
+  VGA_REGION_DMAMEM = 2,  // static arena of ARENA_DMAMEM_SIZE bytes in OCRAM
+  VGA_REGION_EXTMEM = 3   // static arena of ARENA_EXTMEM_SIZE bytes in PSRAM
+};
+
+// size bytes starting on a 32 bytes cache line, NULL if the region is full or not configured
+void * vga_alloc(int size, vga_region_t region);
+
+// give back a block of vga_alloc, arenas reuse the space once the blocks above it are freed
+void vga_free(void * ptr, vga_region_t region);
+
+// bytes still available in an arena (0 for the heap)
+int vga_region_left(vga_region_t region);
+
+#endif //VGA_T4_VGA_ALLOC_HPP
@@ -0,0 +1,149 @@
+//
+// Pixel blending helpers shared by the anti-aliased primitives.
+//
+
+#ifndef VGA_T4_VGA_BLEND_HPP
+#define VGA_T4_VGA_BLEND_HPP
+
+#include "VGA_t4.h"
+
+#if (AA_LEVELS != 4) && (AA_LEVELS != 8)
+#error "AA_LEVELS must be 4 or 8"
+#endif
+
+
+enum class vga_blend_t {
+  VGA_BLEND_OPAQUE = 0,   // source replaces destination
+  VGA_BLEND_HALF = 1,     // 50% average of source and destination
+  VGA_BLEND_ADD = 2,      // per channel add, saturated
+  VGA_BLEND_MULTIPLY = 3, // per channel multiply
+  VGA_BLEND_ALPHA = 4     // level/AA_LEVELS of source through the blend table
+};
+
+namespace VGA_T4 {
+
+#ifndef BITS12
+    // Blend table for RRRGGGBB pixels, built at compile time.
+    // A pixel is split in its RRRGGG and BB parts, each part is blended with a single lookup:
+    //   rg[level-1][(src RRRGGG)<<6 | (dst RRRGGG)]
+    //   b [level-1][(src BB)<<2     | (dst BB)]
+    // Level 0 is the destination and level AA_LEVELS the source, so only the levels
+    // in between are stored.
+    struct VGA_BlendLUT {
+        uint8_t rg[AA_LEVELS-1][64*64];
+        uint8_t b[AA_LEVELS-1][4*4];
+
+        constexpr VGA_BlendLUT() : rg(), b() {
+            for (int l=1; l<AA_LEVELS; l++) {
+                for (int s=0; s<64; s++) {
+                    for (int d=0; d<64; d++) {
+                        rg[l-1][(s<<6)|d] = (uint8_t)((mix(s>>3, d>>3, l)<<5) | (mix(s&7, d&7, l)<<2));
+                    }
+                }
+                for (int s=0; s<4; s++) {
+                    for (int d=0; d<4; d++) {
+                        b[l-1][(s<<2)|d] = (uint8_t)mix(s, d, l);
+                    }
+                }
+            }
+        }
+
+        static constexpr int mix(int s, int d, int l) {
+            return (s*l + d*(AA_LEVELS-l) + AA_LEVELS/2) / AA_LEVELS;
+        }
+    };
+
+    extern const VGA_BlendLUT blend_lut;
+#endif
+
+    // Blend src over dst with a coverage of level/AA_LEVELS
+    static inline vga_pixel vga_blend(vga_pixel src, vga_pixel dst, int level) {
+        if (level <= 0) return dst;
+        if (level >= AA_LEVELS) return src;
+#ifdef BITS12
+        unsigned int inv = AA_LEVELS - level;
+        unsigned int r = (((src>>11)&0x1f)*level + ((dst>>11)&0x1f)*inv) / AA_LEVELS;
+        unsigned int g = (((src>>5)&0x3f)*level + ((dst>>5)&0x3f)*inv) / AA_LEVELS;
+        unsigned int b = ((src&0x1f)*level + (dst&0x1f)*inv) / AA_LEVELS;
+        return (vga_pixel)((r<<11) | (g<<5) | b);
+#else
+        return blend_lut.rg[level-1][((src & 0xfc) << 4) | (dst >> 2)] |
+               blend_lut.b[level-1][((src & 0x03) << 2) | (dst & 0x03)];
+#endif
+    }
+
+#ifdef BITS12
+    // RRRRRGGGGGGBBBBB
+    static inline vga_pixel vga_blend_half(vga_pixel src, vga_pixel dst) {
+        return (vga_pixel)((src & dst) + (((src ^ dst) & 0xf7de) >> 1));
+    }
+
+    static inline vga_pixel vga_blend_add(vga_pixel src, vga_pixel dst) {
+        unsigned int r = ((src>>11)&0x1f) + ((dst>>11)&0x1f);
+        unsigned int g = ((src>>5)&0x3f) + ((dst>>5)&0x3f);
+        unsigned int b = (src&0x1f) + (dst&0x1f);
+        if (r > 0x1f) r = 0x1f;
+        if (g > 0x3f) g = 0x3f;
+        if (b > 0x1f) b = 0x1f;
+        return (vga_pixel)((r<<11) | (g<<5) | b);
+    }
+
+    static inline vga_pixel vga_blend_mul(vga_pixel src, vga_pixel dst) {
+        unsigned int r = (((src>>11)&0x1f) * ((dst>>11)&0x1f) + 15) / 31;
+        unsigned int g = (((src>>5)&0x3f) * ((dst>>5)&0x3f) + 31) / 63;
+        unsigned int b = ((src&0x1f) * (dst&0x1f) + 15) / 31;
+        return (vga_pixel)((r<<11) | (g<<5) | b);
+    }
+#else
+    // RRRGGGBB, also valid on 4 pixels packed in a 32 bits word:
+    // 0x25 holds the lowest bit of each channel, 0x92 the highest one.
+
+    static inline uint32_t vga_blend_half4(uint32_t src, uint32_t dst) {
+        return (src & dst) + (((src ^ dst) & 0xdadadada) >> 1);
+    }
+
+    static inline uint32_t vga_blend_add4(uint32_t src, uint32_t dst) {
+        // add without carry across channels, then saturate the channels that carried out
+        uint32_t sum = ((src & 0x6d6d6d6d) + (dst & 0x6d6d6d6d)) ^ ((src ^ dst) & 0x92929292);
+        uint32_t carry = ((src & dst) | ((src | dst) & ~sum)) & 0x92929292;
+        return sum | carry | (carry >> 1) | ((carry >> 2) & 0x24242424);
+    }
+
+    static inline vga_pixel vga_blend_half(vga_pixel src, vga_pixel dst) {
+        return (vga_pixel)vga_blend_half4(src, dst);
+    }
+
+    static inline vga_pixel vga_blend_add(vga_pixel src, vga_pixel dst) {
+        return (vga_pixel)vga_blend_add4(src, dst);
+    }
+
+    static inline vga_pixel vga_blend_mul(vga_pixel src, vga_pixel dst) {
+        unsigned int r = ((src>>5) * (dst>>5) + 3) / 7;
+        unsigned int g = (((src>>2)&7) * ((dst>>2)&7) + 3) / 7;
+        unsigned int b = ((src&3) * (dst&3) + 1) / 3;
+        return (vga_pixel)((r<<5) | (g<<2) | b);
+    }
+#endif
+
+    static inline vga_pixel vga_blend_pixel(vga_pixel src, vga_pixel dst, vga_blend_t mode, int level) {
+        switch (mode) {
+            case vga_blend_t::VGA_BLEND_HALF:     return vga_blend_half(src, dst);
+            case vga_blend_t::VGA_BLEND_ADD:      return vga_blend_add(src, dst);
+            case vga_blend_t::VGA_BLEND_MULTIPLY: return vga_blend_mul(src, dst);
+            case vga_blend_t::VGA_BLEND_ALPHA:    return vga_blend(src, dst, level);
+            default:                              return src;
+        }
+    }
+
+    // Blend n pixels of src over dst, src pixels at 0 are skipped when key is set
+    void vga_blend_span(vga_pixel *dst, const vga_pixel *src, int n, vga_blend_t mode, int level, bool key);
+
+    // Same, src pixels at keycolor are skipped
+    void vga_blend_span_key(vga_pixel *dst, const vga_pixel *src, int n, vga_blend_t mode, int level, vga_pixel keycolor);
+
+    // Blend a single color over n pixels of dst
+    void vga_blend_fill(vga_pixel *dst, vga_pixel color, int n, vga_blend_t mode, int level);
+
+}
+
+#endif //VGA_T4_VGA_BLEND_HPP
@@ -0,0 +1,119 @@
+//
+// Recorded display list, replayed at vertical blank or behind the beam.
+//
+
+#ifndef VGA_T4_VGA_DISPLAYLIST_HPP
+#define VGA_T4_VGA_DISPLAYLIST_HPP
+
+#include "VGA_GFX.hpp"
+
+namespace VGA_T4 {
+
+    enum class dl_op_t : uint8_t {
+        DL_NOP = 0,
+        DL_CLEAR,
+        DL_PIXEL,
+        DL_RECT,
+        DL_RECT_BLEND,
+        DL_LINE,
+        DL_CIRCLE,
+        DL_FILLED_CIRCLE,
+        DL_TEXT,
+        DL_SPRITE,
+        DL_BLIT
+    };
+
+    // One record, 4 bytes aligned. Text commands are followed by their zero terminated string.
+    struct dl_cmd_t {
+        dl_op_t  op;
+        uint8_t  flags;     // blend mode, double size text, transparent blit
+        uint16_t size;      // record size in bytes, string included
+        int16_t  x, y;
+        int16_t  w, h;      // size, second point or radius depending on op
+        vga_pixel color;
+        vga_pixel color2;   // text background, circle border
+        uint8_t  level;
+        int16_t  stride;    // blit source stride
+        const void * data;  // sprite bitmap or blit source, must stay valid while the list is used
+    };
+
+    class DisplayList {
+    public:
+
+        // Record into caller storage (static, DMAMEM...), size in bytes
+        DisplayList(void *buffer, int size);
+
+        // Record into a malloc'ed buffer of size bytes
+        explicit DisplayList(int size);
+
+        ~DisplayList();
+
+        // forget all recorded commands
+        void clear();
+
+        // =========================================================
+        // recording, returns false (and sets overflow) when full
+        // =========================================================
+
+        bool clear(vga_pixel color);
+
+        bool pixel(int16_t x, int16_t y, vga_pixel color);
+
+        bool rect(int16_t x, int16_t y, int16_t w, int16_t h, vga_pixel color);
+
+        bool rectBlend(int16_t x, int16_t y, int16_t w, int16_t h, vga_pixel color, vga_blend_t mode, int level = AA_LEVELS);
+
+        bool line(int16_t x1, int16_t y1, int16_t x2, int16_t y2, vga_pixel color);
+
+        bool circle(int16_t x, int16_t y, int16_t radius, vga_pixel color);
+
+        bool filledCircle(int16_t x, int16_t y, int16_t radius, vga_pixel fillcolor, vga_pixel bordercolor);
+
+        bool text(int16_t x, int16_t y, const char *text, vga_pixel fgcolor, vga_pixel bgcolor, bool doublesize);
+
+        bool sprite(int16_t x, int16_t y, const int16_t *bitmap);
+
+        bool blit(int16_t x, int16_t y, int16_t w, int16_t h, const vga_pixel *src, int srcstride, bool transparent = false);
+
+        // =========================================================
+        // replay (the list is retained and can be replayed every frame)
+        // =========================================================
+
+        // drop commands hidden by a later clear, group fills of the same color and
+        // bitmaps of the same source when the result is unchanged, merge adjacent ones
+        void optimize();
+
+        // replay now
+        void replay(VGA_HandlerGFX &gfx);
+
+        // wait for the end of the visible area, then replay
+        void replay_vblank(VGA_HandlerGFX &gfx);
+
+        // replay each command as soon as the beam has passed its last line
+        // (for lists recorded top to bottom)
+        void replay_beam(VGA_HandlerGFX &gfx);
+
+        // bin the commands into BIN_TILE_W x BIN_TILE_H screen tiles, render each tile
+        // in a DTCM scratch buffer and write it to the frame buffer once
+        void replay_binned(VGA_HandlerGFX &gfx);
+
+        int used() { return len; }
+        int capacity() { return cap; }
+        bool overflow() { return full; }
+
+    private:
+        uint8_t * buf = NULL;
+        int cap = 0;
+        int len = 0;
+        bool owned = false;
+        bool full = false;
+
+        dl_cmd_t * add(dl_op_t op, int extra);
+        void execute(VGA_HandlerGFX &gfx, const dl_cmd_t *cmd);
+        bool bounds(const dl_cmd_t *cmd, VGA_HandlerGFX &gfx, int &x1, int &y1, int &x2, int &y2);
+        bool covers(const dl_cmd_t *cmd, int x, int y, int w, int h);
+    };
+
+}
+
+#endif //VGA_T4_VGA_DISPLAYLIST_HPP
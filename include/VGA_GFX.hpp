@@ -6,6 +6,7 @@
 #define VGA_T4_VGA_GFX_HPP
 
 #include "VGA_t4.h"
+#include "VGA_Blend.hpp"
 
 namespace VGA_T4 {
 
@@ -20,6 +21,8 @@ namespace VGA_T4 {
 
         void draw_v_line(int16_t x1, int16_t y1, int16_t lenght, vga_pixel color);
 
+        void draw_span(int x1, int x2, int y, vga_pixel color);
+
         void drawcircle(int16_t x, int16_t y, int16_t radius, vga_pixel color);
 
         void drawfilledcircle(int16_t x, int16_t y, int16_t radius, vga_pixel fillcolor, vga_pixel bordercolor);
@@ -46,6 +49,37 @@ namespace VGA_T4 {
         void drawrotatepolygon(int16_t cx, int16_t cy, int16_t Angle, vga_pixel fillcolor, vga_pixel bordercolor,
                                uint8_t filled);
 
+        // =========================================================
+        // anti-aliased primitives (coverage in 0..AA_LEVELS)
+        // =========================================================
+
+        void blendPixel(int x, int y, vga_pixel color, int level);
+
+        void drawaaline(int16_t x1, int16_t y1, int16_t x2, int16_t y2, vga_pixel color);
+
+        void drawaacircle(int16_t x, int16_t y, int16_t radius, vga_pixel color);
+
+        void drawaatext(int16_t x, int16_t y, const char *text, vga_pixel fgcolor);
+
+        // =========================================================
+        // blended primitives (level only used by VGA_BLEND_ALPHA)
+        // =========================================================
+
+        void drawRectBlend(int16_t x, int16_t y, int16_t w, int16_t h, vga_pixel color, vga_blend_t mode,
+                           int level = AA_LEVELS);
+
+        void drawSpriteBlend(int16_t x, int16_t y, const int16_t *bitmap, vga_blend_t mode, int level = AA_LEVELS);
+
+        void blit(int16_t x, int16_t y, int16_t w, int16_t h, const vga_pixel *src, int srcstride, bool transparent = false);
+
+        void blit(int16_t x, int16_t y, const Surface &src, bool transparent = false);
+
+    private:
+
+        void aacircle_points(int cx, int cy, int a, int b, vga_pixel color, int level);
+
+        void ellipse_spans(int cx, int cy, int rx, int ry, vga_pixel color, bool fill);
+
     };
 
 }
@@ -6,45 +6,255 @@
 #define VGA_T4_VGA_GAMEENGINE_HPP
 
 #include "VGA_GFX.hpp"
-#include "VGA_font8x8.h"
+#include "VGA_Alloc.hpp"
 
 
 
 
 
+// screen cells tracked for redraw (up to 640x480)
+#define GE_CELLS_X        ((640 + TILES_W - 1) / TILES_W)
+#define GE_CELLS_Y        ((480 + TILES_H - 1) / TILES_H)
+
+// tile map cell: tile index, flips, priority over sprites, palette added to the tile palette (packed)
+#define TILE_INDEX_MASK   0x03ff
+#define TILE_HFLIP        0x0400
+#define TILE_VFLIP        0x0800
+#define TILE_PRIORITY     0x1000
+#define TILE_PAL_SHIFT    13
+#define TILE_PAL(p)       ((p) << TILE_PAL_SHIFT)
+
+// groups of animated map cells: one per animation, then one per palette
+#define ANIM_GROUPS       (TILES_ANIMS + 16)
+
+// sprite_flip flags, the rotation (clockwise) applies first
+#define SPRITE_HFLIP      0x01
+#define SPRITE_VFLIP      0x02
+#define SPRITE_ROT90      0x04
+
 namespace VGA_T4 {
 
     struct Sprite_t {
-        int x;
+        int x;                          // top left of the frame, not transformed
         int y;
+        int bx;                         // box covered on screen
+        int by;
+        int16_t w;
+        int16_t h;
+        int16_t z;                      // drawn from low to high z, then by id
+        int16_t slot;                   // in the active list, -1 if hidden
         unsigned char index;
+        vga_blend_t blend;
+        unsigned char level;
+        unsigned char palette;
+        unsigned char xform;            // 0, SPRITE_XFORM_FLIP or SPRITE_XFORM_AFFINE
+        unsigned char flip;             // sprite_flip flags
+        unsigned char group;            // collision groups of the sprite (0: not in the grid)
+        unsigned char with;             // groups it collides with
+        unsigned char ncells;           // grid squares it is in
+        int32_t pa;                     // inverse matrix (Q16), screen to frame
+        int32_t pb;
+        int32_t pc;
+        int32_t pd;
+    };
+
+#define SPRITE_XFORM_FLIP    1
+#define SPRITE_XFORM_AFFINE  2
+
+    // rectangle of a sprite frame in the atlas
+    struct Frame_t {
+        uint16_t x;
+        uint16_t y;
+        uint16_t w;
+        uint16_t h;
+        uint16_t * spans;               // compiled opaque runs or NULL (see sprite_compile)
+        uint32_t * mask;                // 1 bit per pixel for collisions or NULL (built when needed)
+    };
+
+    // map pixel (Q16) at the left of a line of a mode 7 layer, and step per screen pixel
+    struct Mode7_t {
+        int32_t u;
+        int32_t v;
+        int32_t du;
+        int32_t dv;
+    };
+
+    // sprite counts of the last run_gfxengine
+    struct SpriteStats_t {
+        int active;                     // shown
+        int visible;                    // on screen
+        int max_line;                   // most sprites on a line
+        int over_lines;                 // lines with more than the limit
+        int dropped;                    // sprites not drawn on those lines (and beyond SPRITES_MAX_REFS)
+    };
+
+    // 2 pixels of a packed byte
+#ifdef BITS12
+    typedef uint32_t vga_pixel2;
+#else
+    typedef uint16_t vga_pixel2;
+#endif
+
+    // reads len cells of a world map layer from col,row, along a row or along a column (vertical)
+    typedef void (*world_reader_t)(int layer, int col, int row, int len, bool vertical, uint16_t *dst);
+
+    struct World_t {
+        const unsigned char * data;     // or cells, or reader
+        const uint16_t * cells;
+        world_reader_t reader;
+        int width;
+        int height;
+        int colstep;
+        int rowstep;
+        int col;                        // world cell cached in the tile map at col,row
+        int row;
+        bool on;
+    };
+
+    // layer_state
+#define LAYER_OPAQUE      0             // no transparent pixel, the layers below are not drawn
+#define LAYER_TRANSPARENT 1             // pixels 0 (color index 0 if packed) show the layers below
+#define LAYER_DISABLED    2
+
+    struct Layer_t {
+        int hscr;                       // x scroll on screen tile rows hscr_beg..hscr_end
+        int vscr;                       // y scroll on screen tile columns vscr_beg..vscr_end
+        int hscr_beg;
+        int hscr_end;
+        int vscr_beg;
+        int vscr_end;
+        const int16_t * hscr_tab;
+        const int16_t * vscr_tab;
+        vga_blend_t mode;
+        unsigned char level;
+        unsigned char state;
+        bool m7_on;
+        int32_t m7_mat[6];
+        const Mode7_t * m7_tab;
+        World_t world;
+    };
+
+    // tile_anim: the tile shows frames[pos], next one every period run_gfxengine
+    struct TileAnim_t {
+        const uint16_t * frames;
+        uint16_t tile;
+        unsigned char count;
+        unsigned char period;
+        unsigned char pos;
+        unsigned char tick;
+    };
+
+    // palette_cycle: colors first..last of a palette rotate by one every period run_gfxengine
+    struct PalCycle_t {
+        unsigned char palette;
+        unsigned char first;
+        unsigned char last;
+        unsigned char period;
+        unsigned char tick;
+    };
+
+    // reads the len bytes of asset index to dst, for master copies not in memory (SD)
+    typedef void (*asset_reader_t)(int index, void *dst, int len);
+
+#define ASSET_NONE        0xffff
+
+    // tile_assets, sprite_assets: the tile and sprite buffers are a least recently used cache
+    struct AssetCache_t {
+        const unsigned char * data;     // master copies one after the other (PROGMEM, EXTMEM), or reader
+        asset_reader_t reader;
+        uint16_t * slot;                // asset -> cache slot, resident if owner[slot] is the asset
+        uint16_t * owner;               // cache slot -> asset or ASSET_NONE
+        uint32_t * stamp;               // cache slot -> last run_gfxengine using it
+        int count;                      // assets, 0 if the buffers are set directly
+        int loads;
     };
 
     class GameEngine : public VGA_HandlerGFX{
     private:
-        vga_pixel * tilesbuffer __attribute__((aligned(32))) = NULL;
-        vga_pixel * spritesbuffer __attribute__((aligned(32))) = NULL;
-        unsigned char * tilesram __attribute__((aligned(32))) = NULL;
-        Sprite_t * spritesdata __attribute__((aligned(32))) = NULL;
+        // in GE_REGION, 32 bytes aligned
+        vga_pixel * tilesbuffer = NULL;
+        vga_pixel * spritesbuffer = NULL;
+        uint16_t * tilesram = NULL;
+        Sprite_t * spritesdata = NULL;
+        Frame_t * frames = NULL;
+        const vga_pixel * atlas = NULL;
+        int atlas_w = 0;
         int nb_layers = 0;
         int nb_tiles = 0;
         int nb_sprites = 0;
-        int hscr[TILES_MAX_LAYERS];
-        int vscr[TILES_MAX_LAYERS];
-        int hscr_beg[TILES_MAX_LAYERS]={0,0};
-        int hscr_end[TILES_MAX_LAYERS]={TILES_ROWS-1, TILES_ROWS-1};
+        int tile_slots = 0;
+        int sprite_slots = 0;
+        bool packed = false;
+        int tile_size = 0;
+        int sprite_size = 0;
+        unsigned char * tile_pal = NULL;
+        vga_pixel palettes[16][16];
+        vga_pixel2 (*pal_pairs)[256] = NULL;      // 16 palettes, packed only
+        vga_pixel key_colors[16][16];             // palettes with color 0 at key_color
+        vga_pixel2 (*key_pairs)[256] = NULL;      // 16 palettes, packed only
+        vga_pixel key_color = 0;
+        int nb_prio = 0;                          // TILE_PRIORITY cells in the maps
+        vga_pixel prio_line[GE_CELLS_X*TILES_W];  // the layers of a line before the sprites
+        Layer_t * layers = NULL;
         int hscr_mask=0;
+        int vscr_mask=0;
+        unsigned char * tile_opq = NULL;
+        uint16_t * tile_rows = NULL;              // pixels not 0 of the tile rows, bit x (TILES_W up to 16)
+        int nb_opq = 0;
+        int bottom = 0;
+        int cull_top = -1;
+        uint16_t spr_active[SPRITES_MAX];        // shown sprites, sorted on z then id
+        int spr_nactive = 0;
+        uint16_t spr_list[SPRITES_MAX];
+        int spr_count = 0;
+        uint16_t band_start[GE_CELLS_Y + 1];
+        uint16_t band_refs[SPRITES_MAX_REFS];
+        int16_t spr_lines[GE_CELLS_Y*TILES_H + 1];
+        int spr_cap = 0;
+        uint64_t over_bands = 0;
+        SpriteStats_t spr_stats = {0, 0, 0, 0, 0};
+        int16_t coll_head[COLL_BUCKETS + 1];      // last list: sprites over more than 4 squares
+        int16_t coll_next[SPRITES_MAX*4];        // node: sprite*4 + square
+        int16_t coll_prev[SPRITES_MAX*4];
+        int16_t coll_bucket[SPRITES_MAX*4];
+        uint16_t coll_stamp[SPRITES_MAX];
+        uint16_t coll_query = 0;
+        unsigned char * tile_flags = NULL;
+        vga_pixel * ring = NULL;
+        vga_pixel * ring_alloc = NULL;      // ring with the scroll pad around it
+        int ring_lines = 0;
+        uint32_t dirty[GE_CELLS_Y][(GE_CELLS_X + 31) / 32];
+        bool dirty_all = true;
+        int world_lines = 2;
+        uint16_t * tile_map = NULL;
+        unsigned char * tile_mark = NULL;
+        TileAnim_t anims[TILES_ANIMS];
+        int nb_anims = 0;
+        PalCycle_t cycles[PAL_CYCLES];
+        int nb_cycles = 0;
+        uint16_t pal_mark = 0;
+        uint16_t * anim_cells = NULL;             // map cells (tilesram positions) per group, see anim_group
+        int anim_start[ANIM_GROUPS+1];
+        bool anim_valid = false;
+        AssetCache_t tile_cache = {};
+        AssetCache_t sprite_cache = {};
+        uint32_t asset_frame = 1;
 
     public:
 
         GameEngine(int vsync_pin = DEFAULT_VSYNC_PIN) : VGA_HandlerGFX(vsync_pin) {}
 
 
-        void begin_gfxengine(int nblayers, int nbtiles, int nbsprites);
+        // packed: tiles and sprites are 4 bits per pixel with palettes
+        void begin_gfxengine(int nblayers, int nbtiles, int nbsprites, bool packed = false);
 
         void run_gfxengine();
 
-        void tile_data(unsigned char index, vga_pixel *data, int len);
+        vga_error_t linemode(int nblines);
+
+        void invalidate();
+
+        void tile_data(int index, vga_pixel *data, int len);
 
         void sprite_data(unsigned char index, vga_pixel *data, int len);
 
@@ -52,12 +262,72 @@ namespace VGA_T4 {
 
         void sprite_hide(int id);
 
-        void tile_draw(int layer, int x, int y, unsigned char index);
+        void sprite_z(int id, int z);
+
+        void sprite_limit(int perline);
+
+        void sprite_flip(int id, int flags);
+
+        void sprite_affine(int id, int32_t pa, int32_t pb, int32_t pc, int32_t pd);
+
+        void sprite_rotozoom(int id, int angle, int32_t scale);
+
+        void sprite_collision(int id, unsigned char group, unsigned char with);
+
+        int sprite_hits(int id, int16_t *ids, int max, bool pixel = true);
+
+        bool sprite_hit(int id1, int id2, bool pixel = true);
+
+        void tile_solid(int index, unsigned char flags);
+
+        unsigned char tile_at(int layer, int x, int y);
+
+        unsigned char tile_hits(int layer, int id);
+
+        const SpriteStats_t & sprite_stats();
+
+        void sprite_atlas(const vga_pixel *image, int width);
+
+        void sprite_frame(int index, int x, int y, int w, int h);
+
+        void sprite_compile(int index);
+
+        void sprite_blend(int id, vga_blend_t mode, int level = AA_LEVELS);
+
+        void set_palette(int index, const vga_pixel *colors);
+
+        void tile_palette(int index, int palette);
+
+        void tile_anim(int index, const uint16_t *frames, int count, int period);
+
+        void palette_cycle(int palette, int first, int last, int period);
+
+        void tile_assets(const void *data, int count);
+
+        void tile_assets(asset_reader_t reader, int count);
+
+        void sprite_assets(const void *data, int count);
+
+        void sprite_assets(asset_reader_t reader, int count);
+
+        int asset_loads();
+
+        void sprite_palette(int id, int palette);
+
+        void layer_blend(int layer, vga_blend_t mode, int level = AA_LEVELS);
+
+        void layer_state(int layer, int state);
+
+        void tile_draw(int layer, int x, int y, uint16_t cell);
 
         void tile_draw_row(int layer, int x, int y, unsigned char *data, int len);
 
         void tile_draw_col(int layer, int x, int y, unsigned char *data, int len);
 
+        void tile_draw_row(int layer, int x, int y, const uint16_t *data, int len);
+
+        void tile_draw_col(int layer, int x, int y, const uint16_t *data, int len);
+
         void set_hscroll(int layer, int rowbeg, int rowend, int mask);
 
         void set_vscroll(int layer, int colbeg, int colend, int mask);
@@ -66,20 +336,74 @@ namespace VGA_T4 {
 
         void vscroll(int layer, int value);
 
+        void hscroll_lines(int layer, const int16_t *table);
+
+        void vscroll_cols(int layer, const int16_t *table);
+
+        void layer_affine(int layer, int32_t a, int32_t b, int32_t c, int32_t d, int32_t u0, int32_t v0);
+
+        void layer_mode7(int layer, const Mode7_t *lines);
+
+        vga_pixel mode7_pixel(int layer, int x, int y);
+
+        void world_map(int layer, const unsigned char *map, int width, int height, bool colmajor = false);
+
+        void world_map(int layer, const uint16_t *map, int width, int height, bool colmajor = false);
+
+        void world_reader(int layer, world_reader_t reader, int width, int height);
+
+        void world_stream(int lines);
+
+        void camera(int layer, int x, int y);
+
 
     private:
 
         //weird used to be static functions
 
-        void drawSpr(unsigned char index, int x, int y);
-        void drawTile(unsigned char tile, int x, int y);
-        void drawTileCropL(unsigned char tile, int x, int y);
-        void drawTileCropR(unsigned char tile, int x, int y);
-        void drawTransTile(unsigned char tile, int x, int y);
-        void drawTransTileCropL(unsigned char tile, int x, int y);
-        void drawTransTileCropR(unsigned char tile, int x, int y);
-        void tileText(unsigned char index, int16_t x, int16_t y, const char * text, vga_pixel fgcolor, vga_pixel bgcolor, vga_pixel *dstbuffer, int dstwidth, int dstheight);
-        void tileTextOverlay(int16_t x, int16_t y, const char * text, vga_pixel fgcolor);
+        void collect_sprites();
+        void active_insert(int id);
+        void active_remove(int id);
+        const vga_pixel * tile_row(uint16_t cell, int ty);
+        const vga_pixel * tile_line(uint16_t cell, int ty, vga_pixel *line, bool keyed);
+        const vga_pixel * sprite_line(const Sprite_t *spr, int row, vga_pixel *line);
+        void compose_tiles(int layer, int y, int xs, int ys, const int16_t *coltab, vga_pixel *dst, int x1, int x2, const vga_pixel *under);
+        void compose_layer(int layer, int y, vga_pixel *dst, int x1, int x2, const vga_pixel *under);
+        uint16_t layer_cell(int layer, int x, int y);
+        bool covered(int layer, int y, int x1, int x2);
+        void compose_span(int y, int x1, int x2, vga_pixel *dst);
+        void mode7_line(int layer, int y, Mode7_t *line);
+        vga_pixel tile_pixel(uint16_t cell, int tx, int ty, bool keyed);
+        void compose_mode7(int layer, int y, vga_pixel *dst, int x1, int x2);
+        void mark_rect(int x, int y, int w, int h);
+        void mark_cell(int layer, int col, int row);
+        void mark_tile(int index);
+        void tile_check(int index);
+        void pal_update(int index);
+        void key_fill(int index);
+        void key_update();
+        void anim_step();
+        int anim_group(uint16_t cell);
+        bool anim_index();
+        void anim_mark(int g, int pal);
+        bool assets_attach(AssetCache_t *c, const void *data, asset_reader_t reader, int count, int slots);
+        int asset_fetch(AssetCache_t *c, int index, int slots, vga_pixel *buffer, int size);
+        void sprite_resident(int index);
+        void assets_update();
+        void tiles_attach(const void *data, asset_reader_t reader, int count);
+        void sprites_attach(const void *data, asset_reader_t reader, int count);
+        void mark_sprite(int id);
+        void sprite_bounds(Sprite_t *spr);
+        void coll_remove(int id);
+        void coll_insert(int id);
+        const uint32_t * frame_mask(int index);
+        bool mask_hit(int id1, int id2);
+        vga_pixel sprite_pixel(const Sprite_t *spr, int u, int v);
+        void compose_xform(const Sprite_t *spr, int row, int col1, int col2, vga_pixel *dst);
+        void frame_changed(int index);
+        void world_attach(int layer, int width, int height, bool colmajor);
+        void world_update(int budget);
+        void world_load(int layer, int wcol, int wrow, bool vertical);
 
     };
 
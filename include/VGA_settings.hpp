@@ -28,6 +28,10 @@ typedef uint8_t vga_pixel;
 #define MaxPolyPoint    100
 #define AUDIO_SAMPLE_BUFFER_SIZE 256
 #define DEFAULT_VSYNC_PIN 8
+// largest overlay cursor (setCursor)
+#define CURSOR_MAX        32
+// largest copper list (copperBegin)
+#define COPPER_MAX        64
 
 #ifndef ABS
 #define ABS(X)  ((X) > 0 ? (X) : -(X))
@@ -102,9 +106,42 @@ typedef uint8_t vga_pixel;
 #define POST_DIV_SELECT 2
 
 
-//########### Game Engine Settings #######################
+//########### Anti-aliasing Settings ####################
+
+// Coverage levels of the anti-aliasing blend table (4 or 8)
+// 4 levels: 12KB table, 8 levels: 28KB table (RRRGGGBB mode only)
+#define AA_LEVELS         4
+// Place the blend table in flash (PROGMEM) instead of DTCM
+//#define AA_LUT_FLASH
+
+
+//########### Binned renderer Settings ##################
+
+// Screen tiles rendered in the DTCM scratch buffer by DisplayList::replay_binned
+#define BIN_TILE_W        32
+#define BIN_TILE_H        32
+// Command references over all tiles (larger lists are replayed directly)
+#define BIN_MAX_REFS      2048
+// Commands DisplayList::optimize looks back over to group a command with a similar one
+#define DL_REORDER_WINDOW 16
+
+
+//########### Memory placement Settings #################
 
-#define TILES_MAX_LAYERS  2
+// Static arenas (bytes) buffers can be placed in, 0 leaves the region out
+// DTCM is the fastest for the CPU, DMAMEM is OCRAM (RAM2), EXTMEM needs PSRAM
+#define ARENA_DTCM_SIZE   0
+#define ARENA_DMAMEM_SIZE 0
+#define ARENA_EXTMEM_SIZE 0
+
+// Region of the frame buffer, of the audio samples and of the game engine buffers:
+// vga_region_t::VGA_REGION_HEAP, _DTCM, _DMAMEM or _EXTMEM (see VGA_Alloc.hpp)
+#define FB_REGION         vga_region_t::VGA_REGION_HEAP
+#define AUDIO_REGION      vga_region_t::VGA_REGION_HEAP
+#define GE_REGION         vga_region_t::VGA_REGION_HEAP
+
+
+//########### Game Engine Settings #######################
 
 // 16x16 pixels tiles or 8x8 if USE_8PIXTILES is set
 //#define USE_8PIXTILES 1
@@ -124,10 +161,22 @@ typedef uint8_t vga_pixel;
 #define TILES_HMASK       0xf
 #endif
 
-// 32 sprites 16x32 or max 64 16x16 (not larger!!!)
-#define SPRITES_MAX       32
+// sprites on screen (hidden ones cost nothing)
+#define SPRITES_MAX       256
+// default sprite frames are SPRITES_W x SPRITES_H, atlas frames up to SPRITES_MAX_W wide
 #define SPRITES_W         16
 #define SPRITES_H         32
+#define SPRITES_MAX_W     64
+// sprites in the bands of TILES_H lines (a sprite is in every band it crosses)
+#define SPRITES_MAX_REFS  (SPRITES_MAX*4)
+
+// collision grid: squares of 1 << COLL_CELL_BITS pixels hashed in COLL_BUCKETS lists (power of 2)
+#define COLL_CELL_BITS    6
+#define COLL_BUCKETS      256
+
+// animated tiles (tile_anim) and palette color cycles (palette_cycle)
+#define TILES_ANIMS       32
+#define PAL_CYCLES        8
 
 
 
@@ -35,6 +35,13 @@ enum class vga_mode_t {
 };
 
 
+enum class copper_op_t {
+  COPPER_BASE = 0,    // lines read from another buffer
+  COPPER_LINE = 1,    // one line repeated
+  COPPER_SCROLL = 2   // lines shifted by some pixels
+};
+
+
 enum class vga_error_t {
 	VGA_OK = 0,
 	VGA_ERROR = -1
@@ -141,13 +148,34 @@ const float calcco[360]={
 
 namespace VGA_T4 {
 
+    // pixels the primitives can draw to: the frame buffer, a tile, a sprite, an offscreen panel...
+    // pixel (px,py) is pixels[py*stride+px], the primitives address it at (x+px,y+py)
+    struct Surface {
+        vga_pixel * pixels;
+        int width;
+        int height;
+        int stride;
+        int x;
+        int y;
+    };
+
+    // copper list entry, run by the scan line ISR at frame buffer line "line"
+    struct CopperOp {
+        int line;
+        copper_op_t op;
+        vga_pixel * pixels;     // BASE, LINE: scan line start (border included), BASE NULL is the frame buffer
+        int value;              // SCROLL: pixels
+    };
+
     class VGA_Handler {
     public:
 
         explicit VGA_Handler(int vsync_pin = DEFAULT_VSYNC_PIN);
 
-        // display VGA image
-        vga_error_t begin(vga_mode_t mode);
+        // display VGA image, without frame buffer (withfb false) the lines come from setLineRing()
+        // height (0: all) lines are shown centered and the frame buffer only holds those,
+        // the lines above and below are one shared line of the letterbox color
+        vga_error_t begin(vga_mode_t mode, bool withfb = true, int height = 0);
 
         void begin_audio(int samplesize, void (*callback)(short *stream, int len));
 
@@ -162,11 +190,17 @@ namespace VGA_T4 {
         // retrieve real size of the frame buffer
         void get_frame_buffer_size(int *width, int *height);
 
+        // color of the lines around a frame buffer of less lines than the mode
+        void setLetterboxColor(vga_pixel color);
+
         // wait next Vsync
         void waitSync();
 
         void waitLine(int line);
 
+        // current scan line (0..524), frame buffer line 0 starts at TOP_BORDER + (fb_top << line_double)
+        int getLine();
+
         // =========================================================
         // graphic primitives
         // =========================================================
@@ -200,6 +234,76 @@ namespace VGA_T4 {
 
         void copyLine(int width, int height, int ysrc, int ydst);
 
+        // =========================================================
+        // drawing target
+        // =========================================================
+
+        // redirect the primitives to buffer, holding the screen area x,y,w,h:
+        // screen pixel (px,py) is stored at buffer[(py-y)*stride+(px-x)], the rest is clipped
+        void setTarget(vga_pixel *buffer, int stride, int x, int y, int w, int h);
+
+        // redirect the primitives to a surface, clipped to it
+        void setTarget(const Surface &surface);
+
+        // current target, to restore it after drawing elsewhere
+        Surface getTarget();
+
+        // the frame buffer as a surface
+        Surface screen();
+
+        // draw to the frame buffer again
+        void resetTarget();
+
+        // =========================================================
+        // overlay plane, merged into the lines at scan out
+        // =========================================================
+
+        // cursor of w x h pixels (pixels 0 are transparent, the top left CURSOR_MAX x CURSOR_MAX
+        // are shown), hotx,hoty is the pixel shown at the position; NULL removes it
+        void setCursor(const vga_pixel *image, int w, int h, int hotx = 0, int hoty = 0);
+
+        // nothing is redrawn, the next frame shows the cursor there
+        void moveCursor(int x, int y);
+
+        // OSD strip shown at its x,y over the picture (pixels 0 show the picture if transparent),
+        // drawn with setTarget(surface) at any time; NULL removes it
+        void setOverlay(const Surface *surface, bool transparent = false);
+
+        // =========================================================
+        // copper list, per line changes made by the scan line ISR
+        // =========================================================
+
+        // start a new list (up to COPPER_MAX entries), lines are frame buffer lines
+        void copperBegin();
+
+        // from line on, line+i shows line i of a buffer laid out like the frame buffer
+        // (fb_stride pixels per line, black borders); NULL goes back to the frame buffer
+        void copperBase(int line, vga_pixel *buffer);
+
+        // from line on, every line shows the same line of pixels laid out like a frame buffer line
+        void copperLine(int line, vga_pixel *pixels);
+
+        // from line on, the picture moves dx pixels left (dx < 0: right), up to the border width,
+        // in steps of 4 pixels (2 with BITS12, dx is rounded toward 0); the borders then show
+        // dx pixels of the line before/after
+        void copperScroll(int line, int dx);
+
+        // the list runs from the next frame on, until the next copperCommit()
+        void copperCommit();
+
+        // =========================================================
+        // scan out source
+        // =========================================================
+
+        // scan out from a ring of nblines lines (power of 2) of fb_stride pixels,
+        // frame buffer line y is read from ring line y & (nblines-1); NULL goes back to the frame buffer
+        void setLineRing(vga_pixel *buffer, int nblines);
+
+        // pixels to keep before and after a buffer scanned out with a copper scroll (frame buffer,
+        // line ring, copperBase/copperLine buffers): its first and last lines are read up to
+        // left_border pixels out of it
+        int scrollPad();
+
         // ************************************** GFX API extension from darthvader ******************************************************
 
     public:
@@ -208,13 +312,23 @@ namespace VGA_T4 {
         static DMAChannel flexio2DMA;
 
         static int  fb_height;
+        static int  fb_top;         // letterbox lines above the frame buffer
+        static int  scan_height;    // lines of the mode
         static int  fb_stride;
         static int  line_double;
         static int  pix_shift;
+        static vga_pixel * line_ring;
+        static int  line_ring_mask;
 
         vga_pixel * framebuffer;
         int  fb_width;
 
+        // where the primitives draw, see setTarget()
+        Surface target_surface;
+        vga_pixel * target;
+        int  target_stride;
+        int  clip_x1, clip_y1, clip_x2, clip_y2; // x2,y2 excluded
+
         int  maxpixperline;
         int  left_border;
         int  right_border;
@@ -0,0 +1,108 @@
+//
+// Placement of the video, audio and engine buffers.
+//
+
+#include "../include/VGA_Alloc.hpp"
+
+/*******************************************************************
+ Arenas:
+ - one static block per region, its size is set in VGA_settings.hpp
+   (0 leaves the region out), so the whole layout is known at link time
+ - blocks are stacked, each one after a 32 bytes header keeping the
+   line alignment; freeing the top block (and the freed ones below)
+   moves the top down, so end() then begin() in another mode reuses
+   the same space instead of fragmenting the heap
+ - heap blocks are malloc'd with room to align them, the malloc'd
+   pointer is kept just before the block
+*******************************************************************/
+
+#define ARENA_ALIGN(n)   (((n) + 31) & ~31)
+#define ARENA_HEADER     32
+
+struct vga_arena_t {
+    uint8_t * base;
+    int size;
+    int top;                            // first free byte
+    int last;                           // header of the top block, -1 if empty
+};
+
+// header before each arena block
+struct vga_block_t {
+    int prev;                           // header of the block below, -1 if none
+    int freed;
+};
+
+#if ARENA_DTCM_SIZE > 0
+static uint8_t arena_dtcm[ARENA_DTCM_SIZE] __attribute__((aligned(32)));
+#endif
+#if ARENA_DMAMEM_SIZE > 0
+DMAMEM static uint8_t arena_dmamem[ARENA_DMAMEM_SIZE] __attribute__((aligned(32)));
+#endif
+#if ARENA_EXTMEM_SIZE > 0
+EXTMEM static uint8_t arena_extmem[ARENA_EXTMEM_SIZE] __attribute__((aligned(32)));
+#endif
+
+static vga_arena_t arenas[4] = {
+    { NULL, 0, 0, -1 },
+#if ARENA_DTCM_SIZE > 0
+    { arena_dtcm, ARENA_DTCM_SIZE, 0, -1 },
+#else
+    { NULL, 0, 0, -1 },
+#endif
+#if ARENA_DMAMEM_SIZE > 0
+    { arena_dmamem, ARENA_DMAMEM_SIZE, 0, -1 },
+#else
+    { NULL, 0, 0, -1 },
+#endif
+#if ARENA_EXTMEM_SIZE > 0
+    { arena_extmem, ARENA_EXTMEM_SIZE, 0, -1 },
+#else
+    { NULL, 0, 0, -1 },
+#endif
+};
+
+void * vga_alloc(int size, vga_region_t region)
+{
+    if (size <= 0) return NULL;
+    if (region == vga_region_t::VGA_REGION_HEAP) {
+        uint8_t * raw = (uint8_t *)malloc(size + 31 + sizeof(void *));
+        if (raw == NULL) return NULL;
+        uint8_t * ptr = (uint8_t *)ARENA_ALIGN((uintptr_t)raw + sizeof(void *));
+        ((void **)ptr)[-1] = raw;
+        return ptr;
+    }
+    vga_arena_t * a = &arenas[(int)region];
+    int need = ARENA_HEADER + ARENA_ALIGN(size);
+    if ( (a->base == NULL) || (need > (a->size - a->top)) ) return NULL;
+    vga_block_t * b = (vga_block_t *)&a->base[a->top];
+    b->prev = a->last;
+    b->freed = 0;
+    a->last = a->top;
+    a->top += need;
+    return &a->base[a->last + ARENA_HEADER];
+}
+
+void vga_free(void * ptr, vga_region_t region)
+{
+    if (ptr == NULL) return;
+    if (region == vga_region_t::VGA_REGION_HEAP) {
+        free(((void **)ptr)[-1]);
+        return;
+    }
+    vga_arena_t * a = &arenas[(int)region];
+    int pos = (uint8_t *)ptr - a->base - ARENA_HEADER;
+    if ( (a->base == NULL) || (pos < 0) || (pos >= a->top) ) return;
+    ((vga_block_t *)&a->base[pos])->freed = 1;
+    while ( (a->last >= 0) && (((vga_block_t *)&a->base[a->last])->freed) )
+    {
+        a->top = a->last;
+        a->last = ((vga_block_t *)&a->base[a->last])->prev;
+    }
+}
+
+int vga_region_left(vga_region_t region)
+{
+    vga_arena_t * a = &arenas[(int)region];
+    int left = a->size - a->top - ARENA_HEADER;
+    return (left > 0) ? (left & ~31) : 0;
+}
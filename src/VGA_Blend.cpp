@@ -0,0 +1,145 @@
+//
+// Pixel blending helpers shared by the anti-aliased primitives.
+//
+
+#include "../include/VGA_Blend.hpp"
+
+#ifndef BITS12
+// Evaluated by the compiler: lands in DTCM with the other constants,
+// or stays in flash when AA_LUT_FLASH is set
+#ifdef AA_LUT_FLASH
+PROGMEM
+#endif
+constexpr VGA_T4::VGA_BlendLUT VGA_T4::blend_lut{};
+#endif
+
+
+#ifndef BITS12
+// 0x80 in each byte of the word that is not 0, spread to 0xff
+static inline uint32_t nonzero_mask4(uint32_t pix) {
+    uint32_t nz = (((pix & 0x7f7f7f7f) + 0x7f7f7f7f) | pix) & 0x80808080;
+    return (nz >> 7) * 0xff;
+}
+
+// 4 pixels at a time for the modes that only need bit operations,
+// dst is 32 bits aligned, src can be unaligned (M7 handles unaligned LDR)
+template <bool KEY>
+static int blend_span4(vga_pixel *dst, const vga_pixel *src, int n, vga_blend_t mode, vga_pixel keycolor) {
+    uint32_t * dst4 = (uint32_t *)dst;
+    uint32_t key4 = keycolor * 0x01010101;
+    int words = n >> 2;
+    if (mode == vga_blend_t::VGA_BLEND_HALF) {
+        for (int i=0; i<words; i++) {
+            uint32_t s, d = dst4[i];
+            memcpy(&s, src, 4);
+            src += 4;
+            if (KEY) {
+                uint32_t m = nonzero_mask4(s ^ key4);
+                if (m) dst4[i] = (VGA_T4::vga_blend_half4(s, d) & m) | (d & ~m);
+            }
+            else dst4[i] = VGA_T4::vga_blend_half4(s, d);
+        }
+    }
+    else {
+        for (int i=0; i<words; i++) {
+            uint32_t s, d = dst4[i];
+            memcpy(&s, src, 4);
+            src += 4;
+            if (KEY) {
+                uint32_t m = nonzero_mask4(s ^ key4);
+                if (m) dst4[i] = (VGA_T4::vga_blend_add4(s, d) & m) | (d & ~m);
+            }
+            else dst4[i] = VGA_T4::vga_blend_add4(s, d);
+        }
+    }
+    return words << 2;
+}
+#endif
+
+// src pixels at keycolor are skipped when key is set
+static void blend_span(vga_pixel *dst, const vga_pixel *src, int n, vga_blend_t mode, int level, bool key, vga_pixel keycolor)
+{
+    if (n <= 0) return;
+    if (mode == vga_blend_t::VGA_BLEND_OPAQUE) {
+        if (!key) {
+            memcpy((void*)dst, (void*)src, n*sizeof(vga_pixel));
+            return;
+        }
+        while (n--) {
+            vga_pixel pix = *src++;
+            if (pix != keycolor) *dst = pix;
+            dst++;
+        }
+        return;
+    }
+
+#ifndef BITS12
+    if ((mode == vga_blend_t::VGA_BLEND_HALF) || (mode == vga_blend_t::VGA_BLEND_ADD)) {
+        while ((n > 0) && ((uintptr_t)dst & 3)) {
+            vga_pixel pix = *src++;
+            if ((!key) || (pix != keycolor)) *dst = VGA_T4::vga_blend_pixel(pix, *dst, mode, level);
+            dst++;
+            n--;
+        }
+        int done = key ? blend_span4<true>(dst, src, n, mode, keycolor) : blend_span4<false>(dst, src, n, mode, keycolor);
+        dst += done;
+        src += done;
+        n -= done;
+    }
+#endif
+
+    while (n--) {
+        vga_pixel pix = *src++;
+        if ((!key) || (pix != keycolor)) *dst = VGA_T4::vga_blend_pixel(pix, *dst, mode, level);
+        dst++;
+    }
+}
+
+void VGA_T4::vga_blend_span(vga_pixel *dst, const vga_pixel *src, int n, vga_blend_t mode, int level, bool key)
+{
+    blend_span(dst, src, n, mode, level, key, 0);
+}
+
+void VGA_T4::vga_blend_span_key(vga_pixel *dst, const vga_pixel *src, int n, vga_blend_t mode, int level, vga_pixel keycolor)
+{
+    blend_span(dst, src, n, mode, level, true, keycolor);
+}
+
+void VGA_T4::vga_blend_fill(vga_pixel *dst, vga_pixel color, int n, vga_blend_t mode, int level)
+{
+    if (n <= 0) return;
+    if (mode == vga_blend_t::VGA_BLEND_OPAQUE) {
+#ifdef BITS12
+        while (n--) *dst++ = color;
+#else
+        memset((void*)dst, color, n);
+#endif
+        return;
+    }
+
+#ifndef BITS12
+    if ((mode == vga_blend_t::VGA_BLEND_HALF) || (mode == vga_blend_t::VGA_BLEND_ADD)) {
+        uint32_t col4 = color * 0x01010101;
+        while ((n > 0) && ((uintptr_t)dst & 3)) {
+            *dst = vga_blend_pixel(color, *dst, mode, level);
+            dst++;
+            n--;
+        }
+        uint32_t * dst4 = (uint32_t *)dst;
+        int words = n >> 2;
+        if (mode == vga_blend_t::VGA_BLEND_HALF) {
+            for (int i=0; i<words; i++) dst4[i] = vga_blend_half4(col4, dst4[i]);
+        }
+        else {
+            for (int i=0; i<words; i++) dst4[i] = vga_blend_add4(col4, dst4[i]);
+        }
+        dst += words << 2;
+        n -= words << 2;
+    }
+#endif
+
+    while (n--) {
+        *dst = vga_blend_pixel(color, *dst, mode, level);
+        dst++;
+    }
+}
@@ -0,0 +1,559 @@
+//
+// Recorded display list, replayed at vertical blank or behind the beam.
+//
+
+#include "../include/VGA_DisplayList.hpp"
+
+/*******************************************************************
+ Display list:
+ - draw calls are recorded as fixed size records in a byte buffer
+ - the list is kept until clear(), so static scenes are recorded once
+   and replayed every frame
+ - optimize() drops everything hidden by a later clear, moves a fill
+   or a bitmap back next to a similar one (fills of the same color,
+   sprites of the same data, blits of the same stride and flags: the
+   source pointer differs for every tile of a sheet, so it is not
+   compared) when nothing in between overlaps it, then merges adjacent
+   fills of the same color and adjacent blits of the same source image
+*******************************************************************/
+
+#define DL_ALIGN(n) (((n) + 3) & ~3)
+
+
+VGA_T4::DisplayList::DisplayList(void *buffer, int size)
+{
+    buf = (uint8_t *)buffer;
+    cap = (buf != NULL) ? size : 0;
+}
+
+VGA_T4::DisplayList::DisplayList(int size)
+{
+    buf = (uint8_t *)malloc(size);
+    cap = (buf != NULL) ? size : 0;
+    owned = true;
+}
+
+VGA_T4::DisplayList::~DisplayList()
+{
+    if ((owned) && (buf != NULL)) free(buf);
+}
+
+void VGA_T4::DisplayList::clear()
+{
+    len = 0;
+    full = false;
+}
+
+VGA_T4::dl_cmd_t * VGA_T4::DisplayList::add(dl_op_t op, int extra)
+{
+    int size = DL_ALIGN(sizeof(dl_cmd_t) + extra);
+    if ((len + size) > cap) {
+        full = true;
+        return NULL;
+    }
+    dl_cmd_t * cmd = (dl_cmd_t *)&buf[len];
+    memset((void*)cmd, 0, sizeof(dl_cmd_t));
+    cmd->op = op;
+    cmd->size = size;
+    len += size;
+    return cmd;
+}
+
+bool VGA_T4::DisplayList::clear(vga_pixel color)
+{
+    dl_cmd_t * cmd = add(dl_op_t::DL_CLEAR, 0);
+    if (cmd == NULL) return false;
+    cmd->color = color;
+    return true;
+}
+
+bool VGA_T4::DisplayList::pixel(int16_t x, int16_t y, vga_pixel color)
+{
+    dl_cmd_t * cmd = add(dl_op_t::DL_PIXEL, 0);
+    if (cmd == NULL) return false;
+    cmd->x = x;
+    cmd->y = y;
+    cmd->color = color;
+    return true;
+}
+
+bool VGA_T4::DisplayList::rect(int16_t x, int16_t y, int16_t w, int16_t h, vga_pixel color)
+{
+    if ((w <= 0) || (h <= 0)) return true;
+    dl_cmd_t * cmd = add(dl_op_t::DL_RECT, 0);
+    if (cmd == NULL) return false;
+    cmd->x = x;
+    cmd->y = y;
+    cmd->w = w;
+    cmd->h = h;
+    cmd->color = color;
+    return true;
+}
+
+bool VGA_T4::DisplayList::rectBlend(int16_t x, int16_t y, int16_t w, int16_t h, vga_pixel color, vga_blend_t mode, int level)
+{
+    if ((w <= 0) || (h <= 0)) return true;
+    dl_cmd_t * cmd = add(dl_op_t::DL_RECT_BLEND, 0);
+    if (cmd == NULL) return false;
+    cmd->x = x;
+    cmd->y = y;
+    cmd->w = w;
+    cmd->h = h;
+    cmd->color = color;
+    cmd->flags = (uint8_t)mode;
+    cmd->level = level;
+    return true;
+}
+
+bool VGA_T4::DisplayList::line(int16_t x1, int16_t y1, int16_t x2, int16_t y2, vga_pixel color)
+{
+    dl_cmd_t * cmd = add(dl_op_t::DL_LINE, 0);
+    if (cmd == NULL) return false;
+    cmd->x = x1;
+    cmd->y = y1;
+    cmd->w = x2;
+    cmd->h = y2;
+    cmd->color = color;
+    return true;
+}
+
+bool VGA_T4::DisplayList::circle(int16_t x, int16_t y, int16_t radius, vga_pixel color)
+{
+    dl_cmd_t * cmd = add(dl_op_t::DL_CIRCLE, 0);
+    if (cmd == NULL) return false;
+    cmd->x = x;
+    cmd->y = y;
+    cmd->w = radius;
+    cmd->color = color;
+    return true;
+}
+
+bool VGA_T4::DisplayList::filledCircle(int16_t x, int16_t y, int16_t radius, vga_pixel fillcolor, vga_pixel bordercolor)
+{
+    dl_cmd_t * cmd = add(dl_op_t::DL_FILLED_CIRCLE, 0);
+    if (cmd == NULL) return false;
+    cmd->x = x;
+    cmd->y = y;
+    cmd->w = radius;
+    cmd->color = fillcolor;
+    cmd->color2 = bordercolor;
+    return true;
+}
+
+bool VGA_T4::DisplayList::text(int16_t x, int16_t y, const char *text, vga_pixel fgcolor, vga_pixel bgcolor, bool doublesize)
+{
+    int n = strlen(text) + 1;
+    dl_cmd_t * cmd = add(dl_op_t::DL_TEXT, n);
+    if (cmd == NULL) return false;
+    cmd->x = x;
+    cmd->y = y;
+    cmd->w = (n - 1) * 8;
+    cmd->h = doublesize ? 16 : 8;
+    cmd->color = fgcolor;
+    cmd->color2 = bgcolor;
+    cmd->flags = doublesize;
+    memcpy((void*)(cmd + 1), (void*)text, n);
+    return true;
+}
+
+bool VGA_T4::DisplayList::sprite(int16_t x, int16_t y, const int16_t *bitmap)
+{
+    dl_cmd_t * cmd = add(dl_op_t::DL_SPRITE, 0);
+    if (cmd == NULL) return false;
+    cmd->x = x;
+    cmd->y = y;
+    cmd->w = bitmap[0];
+    cmd->h = bitmap[1];
+    cmd->data = bitmap;
+    return true;
+}
+
+bool VGA_T4::DisplayList::blit(int16_t x, int16_t y, int16_t w, int16_t h, const vga_pixel *src, int srcstride, bool transparent)
+{
+    if ((w <= 0) || (h <= 0)) return true;
+    dl_cmd_t * cmd = add(dl_op_t::DL_BLIT, 0);
+    if (cmd == NULL) return false;
+    cmd->x = x;
+    cmd->y = y;
+    cmd->w = w;
+    cmd->h = h;
+    cmd->stride = srcstride;
+    cmd->flags = transparent;
+    cmd->data = src;
+    return true;
+}
+
+// area touched by a command (inclusive, not clipped), false when it is not known (clear)
+static bool extent(const VGA_T4::dl_cmd_t *cmd, int &x1, int &y1, int &x2, int &y2)
+{
+    switch (cmd->op) {
+        case VGA_T4::dl_op_t::DL_PIXEL:
+            x1 = x2 = cmd->x;
+            y1 = y2 = cmd->y;
+            return true;
+        case VGA_T4::dl_op_t::DL_LINE:
+            x1 = (cmd->x < cmd->w) ? cmd->x : cmd->w;
+            x2 = (cmd->x < cmd->w) ? cmd->w : cmd->x;
+            y1 = (cmd->y < cmd->h) ? cmd->y : cmd->h;
+            y2 = (cmd->y < cmd->h) ? cmd->h : cmd->y;
+            return true;
+        case VGA_T4::dl_op_t::DL_CIRCLE:
+        case VGA_T4::dl_op_t::DL_FILLED_CIRCLE:
+            x1 = cmd->x - cmd->w;
+            x2 = cmd->x + cmd->w;
+            y1 = cmd->y - cmd->w;
+            y2 = cmd->y + cmd->w;
+            return true;
+        case VGA_T4::dl_op_t::DL_RECT:
+        case VGA_T4::dl_op_t::DL_RECT_BLEND:
+        case VGA_T4::dl_op_t::DL_TEXT:
+        case VGA_T4::dl_op_t::DL_SPRITE:
+        case VGA_T4::dl_op_t::DL_BLIT:
+            x1 = cmd->x;
+            y1 = cmd->y;
+            x2 = cmd->x + cmd->w - 1;
+            y2 = cmd->y + cmd->h - 1;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// commands drawn the same way, worth replaying one after the other
+static bool similar(const VGA_T4::dl_cmd_t *a, const VGA_T4::dl_cmd_t *b)
+{
+    if (a->op != b->op) return false;
+    switch (a->op) {
+        case VGA_T4::dl_op_t::DL_RECT:
+            return (a->color == b->color);
+        case VGA_T4::dl_op_t::DL_SPRITE:
+            return (a->data == b->data);
+        case VGA_T4::dl_op_t::DL_BLIT:
+            // likely the same sheet, merge() checks the pixels follow in it
+            return (a->stride == b->stride) && (a->flags == b->flags);
+        default:
+            return false;
+    }
+}
+
+// b continues a, fill of the same color or blit of the next pixels of the same image
+static bool merge(VGA_T4::dl_cmd_t *a, const VGA_T4::dl_cmd_t *b)
+{
+    if (!similar(a, b)) return false;
+    if (a->op == VGA_T4::dl_op_t::DL_SPRITE) return false;
+    const vga_pixel * src = (const vga_pixel *)a->data;
+    bool blit = (a->op == VGA_T4::dl_op_t::DL_BLIT);
+    if ((a->y == b->y) && (a->h == b->h)) {
+        if (((a->x + a->w) == b->x) && ((!blit) || (b->data == src + a->w))) {
+            a->w += b->w;
+            return true;
+        }
+        if (((b->x + b->w) == a->x) && ((!blit) || (b->data == src - b->w))) {
+            a->x = b->x;
+            a->w += b->w;
+            a->data = b->data;
+            return true;
+        }
+    }
+    if ((a->x == b->x) && (a->w == b->w)) {
+        if (((a->y + a->h) == b->y) && ((!blit) || (b->data == src + a->h*a->stride))) {
+            a->h += b->h;
+            return true;
+        }
+        if (((b->y + b->h) == a->y) && ((!blit) || (b->data == src - b->h*a->stride))) {
+            a->y = b->y;
+            a->h += b->h;
+            a->data = b->data;
+            return true;
+        }
+    }
+    return false;
+}
+
+void VGA_T4::DisplayList::optimize()
+{
+    int pos;
+    int x1, y1, x2, y2, cx1, cy1, cx2, cy2;
+
+    // everything recorded before the last clear is overwritten
+    int lastclear = -1;
+    for (pos = 0; pos < len; pos += ((dl_cmd_t *)&buf[pos])->size) {
+        if (((dl_cmd_t *)&buf[pos])->op == dl_op_t::DL_CLEAR) lastclear = pos;
+    }
+    for (pos = 0; pos < lastclear; pos += ((dl_cmd_t *)&buf[pos])->size) {
+        ((dl_cmd_t *)&buf[pos])->op = dl_op_t::DL_NOP;
+    }
+
+    // move a command back behind the last similar one of the DL_REORDER_WINDOW before it,
+    // when none of the commands it jumps over touches its area (the result is unchanged)
+    int back[DL_REORDER_WINDOW];
+    int nback = 0;
+    for (pos = 0; pos < len; ) {
+        dl_cmd_t * cmd = (dl_cmd_t *)&buf[pos];
+        int size = cmd->size;
+        if (cmd->op == dl_op_t::DL_NOP) {
+            pos += size;
+            continue;
+        }
+        int to = -1;
+        if (extent(cmd, x1, y1, x2, y2)) {
+            for (int k = nback - 1; k >= 0; k--) {
+                dl_cmd_t * other = (dl_cmd_t *)&buf[back[k]];
+                if (similar(other, cmd)) {
+                    if (k < nback - 1) to = k;
+                    break;
+                }
+                if ((!extent(other, cx1, cy1, cx2, cy2)) ||
+                    ((cx1 <= x2) && (x1 <= cx2) && (cy1 <= y2) && (y1 <= cy2))) break;
+            }
+        }
+        if (to >= 0) {
+            // records after back[to] slide by size, the command goes in front of them
+            dl_cmd_t saved = *cmd;
+            int at = back[to] + ((dl_cmd_t *)&buf[back[to]])->size;
+            memmove((void*)&buf[at + size], (void*)&buf[at], pos - at);
+            memcpy((void*)&buf[at], (void*)&saved, size);
+            for (int k = to + 1; k < nback; k++) back[k] += size;
+            if (nback == DL_REORDER_WINDOW) {
+                memmove((void*)back, (void*)&back[1], (--nback)*sizeof(int));
+                to--;
+            }
+            memmove((void*)&back[to + 2], (void*)&back[to + 1], (nback - to - 1)*sizeof(int));
+            back[to + 1] = at;
+            nback++;
+        }
+        else {
+            if (nback == DL_REORDER_WINDOW) memmove((void*)back, (void*)&back[1], (--nback)*sizeof(int));
+            back[nback++] = pos;
+        }
+        pos += size;
+    }
+
+    // merge a fill or a blit into the previous command when it continues it
+    dl_cmd_t * prev = NULL;
+    for (pos = 0; pos < len; pos += ((dl_cmd_t *)&buf[pos])->size) {
+        dl_cmd_t * cmd = (dl_cmd_t *)&buf[pos];
+        if (cmd->op == dl_op_t::DL_NOP) continue;
+        if ((prev != NULL) && (merge(prev, cmd))) {
+            cmd->op = dl_op_t::DL_NOP;
+            continue;
+        }
+        prev = cmd;
+    }
+
+    // compact
+    int dst = 0;
+    for (pos = 0; pos < len; ) {
+        dl_cmd_t * cmd = (dl_cmd_t *)&buf[pos];
+        int size = cmd->size;
+        if (cmd->op != dl_op_t::DL_NOP) {
+            if (dst != pos) memmove((void*)&buf[dst], (void*)cmd, size);
+            dst += size;
+        }
+        pos += size;
+    }
+    len = dst;
+}
+
+void VGA_T4::DisplayList::execute(VGA_HandlerGFX &gfx, const dl_cmd_t *cmd)
+{
+    switch (cmd->op) {
+        case dl_op_t::DL_CLEAR:
+            gfx.clear(cmd->color);
+            break;
+        case dl_op_t::DL_PIXEL:
+            gfx.drawPixel(cmd->x, cmd->y, cmd->color);
+            break;
+        case dl_op_t::DL_RECT:
+            gfx.drawRectBlend(cmd->x, cmd->y, cmd->w, cmd->h, cmd->color, vga_blend_t::VGA_BLEND_OPAQUE);
+            break;
+        case dl_op_t::DL_RECT_BLEND:
+            gfx.drawRectBlend(cmd->x, cmd->y, cmd->w, cmd->h, cmd->color, (vga_blend_t)cmd->flags, cmd->level);
+            break;
+        case dl_op_t::DL_LINE:
+            gfx.drawline(cmd->x, cmd->y, cmd->w, cmd->h, cmd->color);
+            break;
+        case dl_op_t::DL_CIRCLE:
+            gfx.drawcircle(cmd->x, cmd->y, cmd->w, cmd->color);
+            break;
+        case dl_op_t::DL_FILLED_CIRCLE:
+            gfx.drawfilledcircle(cmd->x, cmd->y, cmd->w, cmd->color, cmd->color2);
+            break;
+        case dl_op_t::DL_TEXT:
+            gfx.drawText(cmd->x, cmd->y, (const char *)(cmd + 1), cmd->color, cmd->color2, cmd->flags);
+            break;
+        case dl_op_t::DL_SPRITE:
+            gfx.drawSprite(cmd->x, cmd->y, (const int16_t *)cmd->data);
+            break;
+        case dl_op_t::DL_BLIT:
+            gfx.blit(cmd->x, cmd->y, cmd->w, cmd->h, (const vga_pixel *)cmd->data, cmd->stride, cmd->flags);
+            break;
+        default:
+            break;
+    }
+}
+
+// frame buffer area touched by a command (inclusive), false when off screen
+bool VGA_T4::DisplayList::bounds(const dl_cmd_t *cmd, VGA_HandlerGFX &gfx, int &x1, int &y1, int &x2, int &y2)
+{
+    if (cmd->op == dl_op_t::DL_NOP) return false;
+    if (!extent(cmd, x1, y1, x2, y2)) {
+        x1 = 0;
+        y1 = 0;
+        x2 = gfx.fb_width - 1;
+        y2 = gfx.fb_height - 1;
+    }
+    if (x1 < 0) x1 = 0;
+    if (y1 < 0) y1 = 0;
+    if (x2 >= gfx.fb_width) x2 = gfx.fb_width - 1;
+    if (y2 >= gfx.fb_height) y2 = gfx.fb_height - 1;
+    return ((x1 <= x2) && (y1 <= y2));
+}
+
+// true when the command overwrites every pixel of the area
+bool VGA_T4::DisplayList::covers(const dl_cmd_t *cmd, int x, int y, int w, int h)
+{
+    switch (cmd->op) {
+        case dl_op_t::DL_CLEAR:
+            return true;
+        case dl_op_t::DL_BLIT:
+            if (cmd->flags) return false;
+            // fall through
+        case dl_op_t::DL_RECT:
+        case dl_op_t::DL_SPRITE:
+            return ((cmd->x <= x) && (cmd->y <= y) && ((cmd->x + cmd->w) >= (x + w)) && ((cmd->y + cmd->h) >= (y + h)));
+        default:
+            return false;
+    }
+}
+
+void VGA_T4::DisplayList::replay(VGA_HandlerGFX &gfx)
+{
+    for (int pos = 0; pos < len; ) {
+        const dl_cmd_t * cmd = (const dl_cmd_t *)&buf[pos];
+        execute(gfx, cmd);
+        pos += cmd->size;
+    }
+}
+
+void VGA_T4::DisplayList::replay_vblank(VGA_HandlerGFX &gfx)
+{
+    // frame buffer lines start at fb_top (letterbox)
+    gfx.waitLine(TOP_BORDER + ((gfx.fb_top + gfx.fb_height) << gfx.line_double));
+    replay(gfx);
+}
+
+void VGA_T4::DisplayList::replay_beam(VGA_HandlerGFX &gfx)
+{
+    int visbeg = TOP_BORDER + (gfx.fb_top << gfx.line_double);
+    int visend = TOP_BORDER + ((gfx.fb_top + gfx.fb_height) << gfx.line_double);
+    gfx.waitLine(visbeg);
+    for (int pos = 0; pos < len; ) {
+        const dl_cmd_t * cmd = (const dl_cmd_t *)&buf[pos];
+        int x1, y1, x2, y2;
+        if (!bounds(cmd, gfx, x1, y1, x2, y2)) y2 = gfx.fb_height - 1;
+        int last = TOP_BORDER + ((gfx.fb_top + y2 + 1) << gfx.line_double);
+        if (last > visend) last = visend;
+        int line;
+        // wait while the beam is still above the end of the command (or above the picture)
+        while (((line = gfx.getLine()) < last) && (line >= visbeg)) {};
+        execute(gfx, cmd);
+        pos += cmd->size;
+    }
+}
+
+/*******************************************************************
+ Binned replay:
+ - every command is referenced by the screen tiles its bounds touch
+ - each tile is drawn in a scratch buffer in DTCM with the normal
+   primitives (redirected and clipped with setTarget), starting from
+   the last command that covers the whole tile
+ - the tile is then copied to the frame buffer, so overdraw stays in
+   the scratch buffer and each frame buffer byte is written once
+*******************************************************************/
+
+#define BIN_MAX_TILES (((640 + BIN_TILE_W - 1) / BIN_TILE_W) * ((480 + BIN_TILE_H - 1) / BIN_TILE_H))
+
+static vga_pixel bin_tile[BIN_TILE_W*BIN_TILE_H] __attribute__((aligned(32)));
+static uint16_t bin_start[BIN_MAX_TILES+1];
+static uint16_t bin_fill[BIN_MAX_TILES];
+static uint16_t bin_refs[BIN_MAX_REFS];     // record offsets / 4
+
+void VGA_T4::DisplayList::replay_binned(VGA_HandlerGFX &gfx)
+{
+    int tcols = (gfx.fb_width + BIN_TILE_W - 1) / BIN_TILE_W;
+    int trows = (gfx.fb_height + BIN_TILE_H - 1) / BIN_TILE_H;
+    int ntiles = tcols * trows;
+    int pos, t, tx, ty, x1, y1, x2, y2;
+
+    if ((ntiles > BIN_MAX_TILES) || (len > (0xffff * 4))) {
+        replay(gfx);
+        return;
+    }
+
+    // count the references of each tile
+    memset((void*)bin_start, 0, sizeof(bin_start));
+    int nrefs = 0;
+    for (pos = 0; pos < len; pos += ((dl_cmd_t *)&buf[pos])->size) {
+        if (!bounds((dl_cmd_t *)&buf[pos], gfx, x1, y1, x2, y2)) continue;
+        for (ty = y1 / BIN_TILE_H; ty <= y2 / BIN_TILE_H; ty++) {
+            for (tx = x1 / BIN_TILE_W; tx <= x2 / BIN_TILE_W; tx++) {
+                bin_start[ty*tcols+tx+1]++;
+            }
+        }
+        nrefs += ((y2 / BIN_TILE_H) - (y1 / BIN_TILE_H) + 1) * ((x2 / BIN_TILE_W) - (x1 / BIN_TILE_W) + 1);
+    }
+    if (nrefs > BIN_MAX_REFS) {
+        replay(gfx);
+        return;
+    }
+    for (t = 0; t < ntiles; t++) {
+        bin_start[t+1] += bin_start[t];
+        bin_fill[t] = bin_start[t];
+    }
+
+    // fill the bins, in recording order
+    for (pos = 0; pos < len; pos += ((dl_cmd_t *)&buf[pos])->size) {
+        if (!bounds((dl_cmd_t *)&buf[pos], gfx, x1, y1, x2, y2)) continue;
+        for (ty = y1 / BIN_TILE_H; ty <= y2 / BIN_TILE_H; ty++) {
+            for (tx = x1 / BIN_TILE_W; tx <= x2 / BIN_TILE_W; tx++) {
+                bin_refs[bin_fill[ty*tcols+tx]++] = pos >> 2;
+            }
+        }
+    }
+
+    for (t = 0; t < ntiles; t++) {
+        int first = bin_start[t];
+        int last = bin_start[t+1];
+        if (first == last) continue;
+
+        int x = (t % tcols) * BIN_TILE_W;
+        int y = (t / tcols) * BIN_TILE_H;
+        int w = ((gfx.fb_width - x) < BIN_TILE_W) ? (gfx.fb_width - x) : BIN_TILE_W;
+        int h = ((gfx.fb_height - y) < BIN_TILE_H) ? (gfx.fb_height - y) : BIN_TILE_H;
+
+        // everything before the last covering command is hidden in this tile
+        int i = last - 1;
+        while ((i > first) && (!covers((dl_cmd_t *)&buf[bin_refs[i] << 2], x, y, w, h))) i--;
+        bool covered = covers((dl_cmd_t *)&buf[bin_refs[i] << 2], x, y, w, h);
+        if (!covered) i = first;
+
+        int l;
+        if (!covered) {
+            for (l = 0; l < h; l++) {
+                memcpy((void*)&bin_tile[l*BIN_TILE_W], (void*)&gfx.framebuffer[(y+l)*gfx.fb_stride+x], w*sizeof(vga_pixel));
+            }
+        }
+
+        Surface screen = gfx.getTarget();
+        gfx.setTarget(bin_tile, BIN_TILE_W, x, y, w, h);
+        for (; i < last; i++) {
+            execute(gfx, (dl_cmd_t *)&buf[bin_refs[i] << 2]);
+        }
+        gfx.setTarget(screen);
+
+        for (l = 0; l < h; l++) {
+            memcpy((void*)&gfx.framebuffer[(y+l)*gfx.fb_stride+x], (void*)&bin_tile[l*BIN_TILE_W], w*sizeof(vga_pixel));
+        }
+    }
+}
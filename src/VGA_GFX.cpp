@@ -3,6 +3,7 @@
 //
 
 #include "../include/VGA_GFX.hpp"
+#include "../include/VGA_font8x8.h"
 
 //--------------------------------------------------------------
 // Draw a line between 2 points
@@ -61,7 +62,7 @@ void VGA_T4::VGA_HandlerGFX::drawline(int16_t x1, int16_t y1, int16_t x2, int16_
 // color   : 16bits color
 //--------------------------------------------------------------
 void VGA_T4::VGA_HandlerGFX::draw_h_line(int16_t x, int16_t y, int16_t lenght, vga_pixel color){
-    drawline(x , y , x + lenght , y , color);
+    draw_span(x , x + lenght , y , color);
 }
 
 //--------------------------------------------------------------
@@ -74,6 +75,32 @@ void VGA_T4::VGA_HandlerGFX::draw_v_line(int16_t x, int16_t y, int16_t lenght, v
     drawline(x , y , x , y + lenght , color);
 }
 
+//--------------------------------------------------------------
+// Fill a horizontal span, clipped to the drawing target.
+// x1,x2   : first and last pixel of the span (inclusive, any order)
+// y       : line of the span
+// color   : fill color
+//--------------------------------------------------------------
+void VGA_T4::VGA_HandlerGFX::draw_span(int x1, int x2, int y, vga_pixel color){
+    if ((y < clip_y1) || (y >= clip_y2)) return;
+    if (x1 > x2) {
+        int swap = x1;
+        x1 = x2;
+        x2 = swap;
+    }
+    if (x1 < clip_x1) x1 = clip_x1;
+    if (x2 >= clip_x2) x2 = clip_x2 - 1;
+    if (x1 > x2) return;
+
+    vga_pixel * dst=&target[y*target_stride+x1];
+#ifdef BITS12
+    int n = x2 - x1 + 1;
+    while (n--) *dst++ = color;
+#else
+    memset((void*)dst, color, x2 - x1 + 1);
+#endif
+}
+
 //--------------------------------------------------------------
 // Draw a circle.
 // x, y - center of circle.
@@ -111,153 +138,142 @@ void VGA_T4::VGA_HandlerGFX::drawcircle(int16_t x, int16_t y, int16_t radius, vg
 // radius     : specifies the Circle Radius
 // fillcolor  : specifies the Circle Fill Color
 // bordercolor: specifies the Circle Border Color
+// The inside is filled with one clipped span per line (midpoint
+// algorithm, same outline as drawcircle), no line is drawn twice.
 //--------------------------------------------------------------
 void VGA_T4::VGA_HandlerGFX::drawfilledcircle(int16_t x, int16_t y, int16_t radius, vga_pixel fillcolor, vga_pixel bordercolor){
-    int32_t  D;    /* Decision Variable */
-    uint32_t  CurX;/* Current X Value */
-    uint32_t  CurY;/* Current Y Value */
-
-    D = 3 - (radius << 1);
+    int a = 0;
+    int b = radius;
+    int P = 1 - radius;
 
-    CurX = 0;
-    CurY = radius;
+    if (radius < 0) return;
 
-    while (CurX <= CurY)
+    while (a <= b)
     {
-        if(CurY > 0)
-        {
-            draw_v_line(x - CurX, y - CurY, 2*CurY, fillcolor);
-            draw_v_line(x + CurX, y - CurY, 2*CurY, fillcolor);
-        }
+        // lines y+a and y-a are visited once each, b is their half width
+        draw_span(x - b, x + b, y + a, fillcolor);
+        if (a > 0) draw_span(x - b, x + b, y - a, fillcolor);
 
-        if(CurX > 0)
+        if (P < 0)
         {
-            draw_v_line(x - CurY, y - CurX, 2*CurX, fillcolor);
-            draw_v_line(x + CurY, y - CurX, 2*CurX, fillcolor);
-        }
-        if (D < 0)
-        {
-            D += (CurX << 2) + 6;
+            P += 3 + 2*a;
         }
         else
         {
-            D += ((CurX - CurY) << 2) + 10;
-            CurY--;
+            // b is about to change: a is the widest span for lines y+b and y-b
+            if (b > a)
+            {
+                draw_span(x - a, x + a, y + b, fillcolor);
+                draw_span(x - a, x + a, y - b, fillcolor);
+            }
+            P += 5 + 2*(a - b);
+            b--;
         }
-        CurX++;
+        a++;
     }
 
     drawcircle(x, y, radius,bordercolor);
 }
 
 //--------------------------------------------------------------
-// Displays an Ellipse.
-// cx: specifies the X position
-// cy: specifies the Y position
-// radius1: minor radius of ellipse.
-// radius2: major radius of ellipse.
-// color: specifies the Color to use for draw the Border from the Ellipse.
+// Walk one quadrant of an ellipse with the integer midpoint
+// algorithm (all decision terms scaled by 4, no division).
+// fill = false: plot the 4 symmetric outline points.
+// fill = true : emit one clipped span per line, using the
+//               widest x reached on that line.
 //--------------------------------------------------------------
-void VGA_T4::VGA_HandlerGFX::drawellipse(int16_t cx, int16_t cy, int16_t radius1, int16_t radius2, vga_pixel color){
-    int x = -radius1, y = 0, err = 2-2*radius1, e2;
-    float K = 0, rad1 = 0, rad2 = 0;
-
-    rad1 = radius1;
-    rad2 = radius2;
+void VGA_T4::VGA_HandlerGFX::ellipse_spans(int cx, int cy, int rx, int ry, vga_pixel color, bool fill){
+    if ((rx < 0) || (ry < 0)) return;
+    if (ry == 0) {
+        draw_span(cx - rx, cx + rx, cy, color);
+        return;
+    }
 
-    if (radius1 > radius2)
+    int64_t rx2 = (int64_t)rx*rx;
+    int64_t ry2 = (int64_t)ry*ry;
+    int x = 0;
+    int y = ry;
+    int64_t px = 0;
+    int64_t py = 2*rx2*y;
+    int curx = 0;
+    int cury = ry;
+
+    // Region 1: slope > -1, x steps every iteration
+    int64_t p = 4*ry2 - 4*rx2*ry + rx2;
+    while (px < py)
     {
-        do {
-            K = (float)(rad1/rad2);
-            drawPixel(cx-x,cy+(uint16_t)(y/K),color);
-            drawPixel(cx+x,cy+(uint16_t)(y/K),color);
-            drawPixel(cx+x,cy-(uint16_t)(y/K),color);
-            drawPixel(cx-x,cy-(uint16_t)(y/K),color);
-
-            e2 = err;
-            if (e2 <= y) {
-                err += ++y*2+1;
-                if (-x == y && e2 <= x) e2 = 0;
+        if (fill) {
+            curx = x;
+        } else {
+            drawPixel(cx+x, cy+y, color);
+            drawPixel(cx-x, cy+y, color);
+            drawPixel(cx+x, cy-y, color);
+            drawPixel(cx-x, cy-y, color);
+        }
+        x++;
+        px += 2*ry2;
+        if (p < 0) {
+            p += 4*(ry2 + px);
+        }
+        else {
+            if (fill) {
+                draw_span(cx - curx, cx + curx, cy + cury, color);
+                draw_span(cx - curx, cx + curx, cy - cury, color);
             }
-            if (e2 > x) err += ++x*2+1;
+            y--;
+            cury = y;
+            py -= 2*rx2;
+            p += 4*(ry2 + px - py);
         }
-        while (x <= 0);
     }
-    else
+
+    // Region 2: slope < -1, y steps every iteration
+    p = ry2*(4*(int64_t)x*x + 4*x + 1) + 4*rx2*((int64_t)(y-1)*(y-1)) - 4*rx2*ry2;
+    while (y >= 0)
     {
-        y = -radius2;
-        x = 0;
-        do {
-            K = (float)(rad2/rad1);
-            drawPixel(cx-(uint16_t)(x/K),cy+y,color);
-            drawPixel(cx+(uint16_t)(x/K),cy+y,color);
-            drawPixel(cx+(uint16_t)(x/K),cy-y,color);
-            drawPixel(cx-(uint16_t)(x/K),cy-y,color);
-
-            e2 = err;
-            if (e2 <= x) {
-                err += ++x*2+1;
-                if (-y == x && e2 <= y) e2 = 0;
-            }
-            if (e2 > y) err += ++y*2+1;
+        if (fill) {
+            draw_span(cx - x, cx + x, cy + y, color);
+            if (y > 0) draw_span(cx - x, cx + x, cy - y, color);
+        } else {
+            drawPixel(cx+x, cy+y, color);
+            drawPixel(cx-x, cy+y, color);
+            drawPixel(cx+x, cy-y, color);
+            drawPixel(cx-x, cy-y, color);
+        }
+        y--;
+        py -= 2*rx2;
+        if (p > 0) {
+            p += 4*(rx2 - py);
+        }
+        else {
+            x++;
+            px += 2*ry2;
+            p += 4*(rx2 - py + px);
         }
-        while (y <= 0);
     }
 }
 
+//--------------------------------------------------------------
+// Displays an Ellipse.
+// cx: specifies the X position
+// cy: specifies the Y position
+// radius1: horizontal radius of ellipse.
+// radius2: vertical radius of ellipse.
+// color: specifies the Color to use for draw the Border from the Ellipse.
+//--------------------------------------------------------------
+void VGA_T4::VGA_HandlerGFX::drawellipse(int16_t cx, int16_t cy, int16_t radius1, int16_t radius2, vga_pixel color){
+    ellipse_spans(cx, cy, radius1, radius2, color, false);
+}
+
 // Draw a filled ellipse.
 // cx: specifies the X position
 // cy: specifies the Y position
-// radius1: minor radius of ellipse.
-// radius2: major radius of ellipse.
+// radius1: horizontal radius of ellipse.
+// radius2: vertical radius of ellipse.
 // fillcolor  : specifies the Color to use for Fill the Ellipse.
 // bordercolor: specifies the Color to use for draw the Border from the Ellipse.
 void VGA_T4::VGA_HandlerGFX::drawfilledellipse(int16_t cx, int16_t cy, int16_t radius1, int16_t radius2, vga_pixel fillcolor, vga_pixel bordercolor){
-    int x = -radius1, y = 0, err = 2-2*radius1, e2;
-    float K = 0, rad1 = 0, rad2 = 0;
-
-    rad1 = radius1;
-    rad2 = radius2;
-
-    if (radius1 > radius2)
-    {
-        do
-        {
-            K = (float)(rad1/rad2);
-            draw_v_line((cx+x), (cy-(uint16_t)(y/K)), (2*(uint16_t)(y/K) + 1) , fillcolor);
-            draw_v_line((cx-x), (cy-(uint16_t)(y/K)), (2*(uint16_t)(y/K) + 1) , fillcolor);
-
-            e2 = err;
-            if (e2 <= y)
-            {
-                err += ++y*2+1;
-                if (-x == y && e2 <= x) e2 = 0;
-            }
-            if (e2 > x) err += ++x*2+1;
-
-        }
-        while (x <= 0);
-    }
-    else
-    {
-        y = -radius2;
-        x = 0;
-        do
-        {
-            K = (float)(rad2/rad1);
-            draw_h_line((cx-(uint16_t)(x/K)), (cy+y), (2*(uint16_t)(x/K) + 1) , fillcolor);
-            draw_h_line((cx-(uint16_t)(x/K)), (cy-y), (2*(uint16_t)(x/K) + 1) , fillcolor);
-
-            e2 = err;
-            if (e2 <= x)
-            {
-                err += ++x*2+1;
-                if (-y == x && e2 <= y) e2 = 0;
-            }
-            if (e2 > y) err += ++y*2+1;
-        }
-        while (y <= 0);
-    }
+    ellipse_spans(cx, cy, radius1, radius2, fillcolor, true);
     drawellipse(cx,cy,radius1,radius2,bordercolor);
 }
 
@@ -602,4 +618,232 @@ void VGA_T4::VGA_HandlerGFX::drawrotatepolygon(int16_t cx, int16_t cy, int16_t A
         PolySet.Pts[n] = SavePts[n];
         n++;
     }
-}
\ No newline at end of file
+}
+//--------------------------------------------------------------
+// Blend a pixel over the drawing target.
+// x,y     : position (clipped)
+// color   : color to blend
+// level   : coverage, 0 keeps the target, AA_LEVELS is opaque
+//--------------------------------------------------------------
+void VGA_T4::VGA_HandlerGFX::blendPixel(int x, int y, vga_pixel color, int level){
+    if ((level <= 0) || (x < clip_x1) || (x >= clip_x2) || (y < clip_y1) || (y >= clip_y2)) return;
+    vga_pixel * dst=&target[y*target_stride+x];
+    *dst = vga_blend(color, *dst, level);
+}
+
+//--------------------------------------------------------------
+// Draw an anti-aliased line (Xiaolin Wu).
+// x1,y1   : 1st point
+// x2,y2   : 2nd point
+// color   : line color
+// The minor axis is stepped in 16.16 fixed point, the fraction
+// splits the coverage between the 2 pixels straddling the line.
+//--------------------------------------------------------------
+void VGA_T4::VGA_HandlerGFX::drawaaline(int16_t x1, int16_t y1, int16_t x2, int16_t y2, vga_pixel color){
+    int dx = x2 - x1;
+    int dy = y2 - y1;
+
+    // horizontal, vertical and diagonal lines have no partial coverage
+    if ((dx == 0) || (dy == 0) || (ABS(dx) == ABS(dy))) {
+        drawline(x1, y1, x2, y2, color);
+        return;
+    }
+
+    if (ABS(dx) > ABS(dy)) {
+        if (dx < 0) {
+            int16_t swap;
+            swap = x1; x1 = x2; x2 = swap;
+            swap = y1; y1 = y2; y2 = swap;
+            dx = -dx;
+            dy = -dy;
+        }
+        int32_t grad = (dy * 65536) / dx;
+        int32_t yf = y1 * 65536;
+        for (int x = x1; x <= x2; x++) {
+            int level = ((0xffff - (yf & 0xffff)) * AA_LEVELS + 0x8000) >> 16;
+            blendPixel(x, yf >> 16, color, level);
+            blendPixel(x, (yf >> 16) + 1, color, AA_LEVELS - level);
+            yf += grad;
+        }
+    }
+    else {
+        if (dy < 0) {
+            int16_t swap;
+            swap = x1; x1 = x2; x2 = swap;
+            swap = y1; y1 = y2; y2 = swap;
+            dx = -dx;
+            dy = -dy;
+        }
+        int32_t grad = (dx * 65536) / dy;
+        int32_t xf = x1 * 65536;
+        for (int y = y1; y <= y2; y++) {
+            int level = ((0xffff - (xf & 0xffff)) * AA_LEVELS + 0x8000) >> 16;
+            blendPixel(xf >> 16, y, color, level);
+            blendPixel((xf >> 16) + 1, y, color, AA_LEVELS - level);
+            xf += grad;
+        }
+    }
+}
+
+//--------------------------------------------------------------
+// Blend the (up to) 8 symmetric points of a circle octant,
+// points shared by 2 octants are blended only once.
+//--------------------------------------------------------------
+void VGA_T4::VGA_HandlerGFX::aacircle_points(int cx, int cy, int a, int b, vga_pixel color, int level){
+    blendPixel(cx+a, cy+b, color, level);
+    blendPixel(cx+a, cy-b, color, level);
+    if (a != 0) {
+        blendPixel(cx-a, cy+b, color, level);
+        blendPixel(cx-a, cy-b, color, level);
+    }
+    if (a != b) {
+        blendPixel(cx+b, cy+a, color, level);
+        blendPixel(cx-b, cy+a, color, level);
+        if (a != 0) {
+            blendPixel(cx+b, cy-a, color, level);
+            blendPixel(cx-b, cy-a, color, level);
+        }
+    }
+}
+
+//--------------------------------------------------------------
+// Draw an anti-aliased circle.
+// x, y    : center of circle.
+// radius  : radius.
+// color   : color of the circle.
+//--------------------------------------------------------------
+void VGA_T4::VGA_HandlerGFX::drawaacircle(int16_t x, int16_t y, int16_t radius, vga_pixel color){
+    if (radius <= 0) {
+        if (radius == 0) blendPixel(x, y, color, AA_LEVELS);
+        return;
+    }
+
+    int32_t r2 = (int32_t)radius*radius;
+    for (int a = 0; ; a++) {
+        float bf = sqrtf((float)(r2 - a*a));
+        int b = (int)bf;
+        if (b < a) break;
+        int level = (int)((bf - b) * AA_LEVELS + 0.5f);
+        aacircle_points(x, y, a, b, color, AA_LEVELS - level);
+        aacircle_points(x, y, a, b + 1, color, level);
+    }
+}
+
+//--------------------------------------------------------------
+// Draw a text with smoothed edges, background is kept.
+// x,y     : top left position
+// text    : zero terminated string (8x8 font)
+// fgcolor : text color
+// Empty pixels closing a diagonal step of the glyph (one
+// horizontal and one vertical neighbour set) get half coverage.
+//--------------------------------------------------------------
+void VGA_T4::VGA_HandlerGFX::drawaatext(int16_t x, int16_t y, const char * text, vga_pixel fgcolor){
+    unsigned char c;
+
+    while ((c = *text++)) {
+        const unsigned char * charpt=&font8x8[c][0];
+        for (int i=0; i<8; i++)
+        {
+            unsigned int bits = charpt[i];
+            unsigned int up = (i > 0) ? charpt[i-1] : 0;
+            unsigned int down = (i < 7) ? charpt[i+1] : 0;
+            // horizontal neighbours of each bit, vertical neighbours of each bit
+            unsigned int hnb = ((bits << 1) | (bits >> 1)) & 0xff;
+            unsigned int vnb = up | down;
+            unsigned int edge = hnb & vnb & ~bits;
+            for (int b=0; b<8; b++)
+            {
+                if ((bits >> b) & 1) blendPixel(x+b, y+i, fgcolor, AA_LEVELS);
+                else if ((edge >> b) & 1) blendPixel(x+b, y+i, fgcolor, AA_LEVELS/2);
+            }
+        }
+        x += 8;
+    }
+}
+
+//--------------------------------------------------------------
+// Blend a filled rectangle over the drawing target.
+// x,y,w,h : rectangle (clipped)
+// color   : fill color
+// mode    : blend mode
+// level   : coverage for VGA_BLEND_ALPHA (0..AA_LEVELS)
+//--------------------------------------------------------------
+void VGA_T4::VGA_HandlerGFX::drawRectBlend(int16_t x, int16_t y, int16_t w, int16_t h, vga_pixel color, vga_blend_t mode, int level){
+    int x1 = x, y1 = y, x2 = x + w, y2 = y + h;
+    if (x1 < clip_x1) x1 = clip_x1;
+    if (y1 < clip_y1) y1 = clip_y1;
+    if (x2 > clip_x2) x2 = clip_x2;
+    if (y2 > clip_y2) y2 = clip_y2;
+    if ((x1 >= x2) || (y1 >= y2)) return;
+
+    for (int l=y1; l<y2; l++)
+    {
+        vga_blend_fill(&target[l*target_stride+x1], color, x2 - x1, mode, level);
+    }
+}
+
+//--------------------------------------------------------------
+// Blend a 16bits bitmap (see drawSprite) over the drawing target.
+// x,y     : top left position (clipped)
+// bitmap  : width, height, then RGB565 pixels
+// mode    : blend mode
+// level   : coverage for VGA_BLEND_ALPHA (0..AA_LEVELS)
+// Pixels are converted in chunks so the blend runs on packed pixels.
+//--------------------------------------------------------------
+void VGA_T4::VGA_HandlerGFX::drawSpriteBlend(int16_t x, int16_t y, const int16_t *bitmap, vga_blend_t mode, int level){
+    vga_pixel line[64];
+    int w = *bitmap++;
+    int h = *bitmap++;
+
+    int col1 = (x < clip_x1) ? clip_x1 - x : 0;
+    int row1 = (y < clip_y1) ? clip_y1 - y : 0;
+    int col2 = ((x + w) > clip_x2) ? clip_x2 - x : w;
+    int row2 = ((y + h) > clip_y2) ? clip_y2 - y : h;
+    if ((col1 >= col2) || (row1 >= row2)) return;
+
+    for (int row=row1; row<row2; row++)
+    {
+        const int16_t * src = &bitmap[row*w];
+        vga_pixel * dst = &target[(y+row)*target_stride+x];
+        for (int col=col1; col<col2; col+=64)
+        {
+            int n = ((col2 - col) < 64) ? (col2 - col) : 64;
+            for (int i=0; i<n; i++)
+            {
+                uint16_t pix = src[col+i];
+                line[i] = VGA_RGB(R16(pix),G16(pix),B16(pix));
+            }
+            vga_blend_span(&dst[col], line, n, mode, level, false);
+        }
+    }
+}
+
+//--------------------------------------------------------------
+// Copy a block of pixels to the drawing target.
+// x,y,w,h    : destination rectangle (clipped)
+// src        : first pixel of the block
+// srcstride  : pixels between 2 lines of the block
+// transparent: skip pixels at 0
+//--------------------------------------------------------------
+void VGA_T4::VGA_HandlerGFX::blit(int16_t x, int16_t y, int16_t w, int16_t h, const vga_pixel *src, int srcstride, bool transparent){
+    int col1 = (x < clip_x1) ? clip_x1 - x : 0;
+    int row1 = (y < clip_y1) ? clip_y1 - y : 0;
+    int col2 = ((x + w) > clip_x2) ? clip_x2 - x : w;
+    int row2 = ((y + h) > clip_y2) ? clip_y2 - y : h;
+    if ((col1 >= col2) || (row1 >= row2)) return;
+
+    vga_blend_t mode = vga_blend_t::VGA_BLEND_OPAQUE;
+    for (int row=row1; row<row2; row++)
+    {
+        vga_blend_span(&target[(y+row)*target_stride+x+col1], &src[row*srcstride+col1], col2-col1, mode, AA_LEVELS, transparent);
+    }
+}
+
+//--------------------------------------------------------------
+// Copy a whole surface (prerendered sprite, panel...) to the drawing target.
+// x,y        : destination of its top left pixel (clipped)
+// transparent: skip pixels at 0
+//--------------------------------------------------------------
+void VGA_T4::VGA_HandlerGFX::blit(int16_t x, int16_t y, const Surface &src, bool transparent){
+    blit(x, y, src.width, src.height, src.pixels, src.stride, transparent);
+}
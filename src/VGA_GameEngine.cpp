@@ -7,8 +7,8 @@
 /*******************************************************************
  Experimental GAME engine supporting:
  - Multiple tiles layers with independent scrolling
- - Sprites (MAX_SPRITES)
- - up to 256 redefinable tiles
+ - Sprites (SPRITES_MAX) of any size up to SPRITES_MAX_W, from an atlas, z ordered
+ - up to 1024 redefinable tiles, flipped and above sprites per map cell
  - up to 256 redefinable sprites
 *******************************************************************/
 
@@ -16,411 +16,2387 @@
 
 
 
-void VGA_T4::GameEngine::drawSpr(unsigned char index, int x, int y) {
-    if ((x + SPRITES_W) <= 0) return;
-    if (x >= (fb_width-hscr_mask)) return;
-    if ((y + SPRITES_H) <= 0) return;
-    if (y >= fb_height) return;
+/*******************************************************************
+ Line compositor:
+ - every output line is built from the tile rows it crosses
+   (with the scroll of the layer) and the sprites it crosses
+ - lines go to the frame buffer, or just ahead of the beam into a
+   small ring of lines scanned out instead of the frame buffer
+   (see linemode), so cost follows the visible pixels
+*******************************************************************/
+
+/*******************************************************************
+ Sprite bands:
+ - the active list is kept sorted on z then id (sprite, sprite_hide
+   and sprite_z move one entry), once per frame the visible sprites
+   are taken from it in order, then put in the bands of TILES_H lines
+   they cross (counting sort), a line only walks the sprites of its band
+ - with sprite_limit, a line draws its last perline sprites (the
+   highest z), the others are dropped like on sprite hardware
+*******************************************************************/
+
+// visible sprites of the active list, in drawing order, then per band
+void VGA_T4::GameEngine::collect_sprites() {
+    int xend = (hscr_mask > 0) ? (fb_width - hscr_mask + 1) : fb_width;
+    spr_count = 0;
+    for (int i=0; i<spr_nactive; i++)
+    {
+        int id = spr_active[i];
+        Sprite_t * spr = &spritesdata[id];
+        if ( ((spr->bx + spr->w) <= 0) || (spr->bx >= xend) ) continue;
+        if ( ((spr->by + spr->h) <= 0) || (spr->by >= fb_height) ) continue;
+        spr_list[spr_count++] = id;
+    }
+
+    // count per band and per line (differences)
+    int nbands = (fb_height + TILES_H - 1) >> TILES_HBITS;
+    memset((void*)band_start, 0, sizeof(band_start));
+    memset((void*)spr_lines, 0, (fb_height+1)*sizeof(int16_t));
+    spr_stats.active = spr_nactive;
+    spr_stats.visible = spr_count;
+    spr_stats.dropped = 0;
+    int refs = 0;
+    for (int i=0; i<spr_count; i++)
+    {
+        Sprite_t * spr = &spritesdata[spr_list[i]];
+        int y1 = (spr->by < 0) ? 0 : spr->by;
+        int y2 = ((spr->by + spr->h) > fb_height) ? fb_height : spr->by + spr->h;
+        int b1 = y1 >> TILES_HBITS;
+        int b2 = (y2 - 1) >> TILES_HBITS;
+        if ((refs + b2 - b1 + 1) > SPRITES_MAX_REFS) {
+            spr_stats.dropped += spr_count - i;
+            spr_count = i;
+            break;
+        }
+        refs += b2 - b1 + 1;
+        for (int b=b1; b<=b2; b++) band_start[b+1]++;
+        spr_lines[y1]++;
+        spr_lines[y2]--;
+    }
+    for (int b=0; b<nbands; b++) band_start[b+1] += band_start[b];
+
+    // fill the bands in drawing order (band_start[b] ends at the start of band b+1, then is restored)
+    for (int i=0; i<spr_count; i++)
+    {
+        Sprite_t * spr = &spritesdata[spr_list[i]];
+        int y1 = (spr->by < 0) ? 0 : spr->by;
+        int y2 = ((spr->by + spr->h) > fb_height) ? fb_height : spr->by + spr->h;
+        for (int b=y1 >> TILES_HBITS; b<=((y2 - 1) >> TILES_HBITS); b++) band_refs[band_start[b]++] = spr_list[i];
+    }
+    for (int b=nbands; b>0; b--) band_start[b] = band_start[b-1];
+    band_start[0] = 0;
+
+    // lines over the limit
+    uint64_t over = 0;
+    int n = 0;
+    spr_stats.max_line = 0;
+    spr_stats.over_lines = 0;
+    for (int y=0; y<fb_height; y++)
+    {
+        n += spr_lines[y];
+        if (n > spr_stats.max_line) spr_stats.max_line = n;
+        if ( (spr_cap > 0) && (n > spr_cap) ) {
+            spr_stats.over_lines++;
+            spr_stats.dropped += n - spr_cap;
+            over |= (uint64_t)1 << (y >> TILES_HBITS);
+        }
+    }
+
+    // which sprites a line drops depends on all the sprites of the line
+    uint64_t redraw = over | over_bands;
+    over_bands = over;
+    for (int b=0; redraw; b++, redraw >>= 1)
+    {
+        if (redraw & 1) mark_rect(0, b << TILES_HBITS, fb_width, TILES_H);
+    }
+}
+
+/*******************************************************************
+ Packed tiles and sprites (begin_gfxengine with packed):
+ - 2 pixels per byte, left pixel in the low nibble
+ - a pixel is a color of one of 16 palettes of 16 colors, selected
+   per tile definition (tile_palette) or per sprite (sprite_palette)
+ - rows are expanded while composing with a table per palette giving
+   the 2 pixels of a byte
+ - color 0 is transparent whatever its value: the keyed tables give
+   key_color for it, a value none of the other colors of the palettes
+   has (there are 240 of them for 256 values), and the blend skips
+   key_color
+*******************************************************************/
+
+static inline void expand4(vga_pixel *dst, const unsigned char *src, int n, const VGA_T4::vga_pixel2 *pairs) {
+    for (int i=0; i<n; i+=2) {
+        VGA_T4::vga_pixel2 p = pairs[*src++];
+        memcpy((void*)&dst[i], (void*)&p, sizeof(p));
+    }
+}
+
+// same from the last byte, the 2 pixels of a byte swapped
+static inline void expand4_hflip(vga_pixel *dst, const unsigned char *src, int n, const VGA_T4::vga_pixel2 *pairs) {
+    src += n/2;
+    for (int i=0; i<n; i+=2) {
+        VGA_T4::vga_pixel2 p = pairs[*--src];
+#ifdef BITS12
+        p = (p >> 16) | (p << 16);
+#else
+        p = __builtin_bswap16(p);
+#endif
+        memcpy((void*)&dst[i], (void*)&p, sizeof(p));
+    }
+}
+
+// n pixels reversed, a 32 bits word at a time (4 pixels, 2 with BITS12)
+static inline void copy_hflip(vga_pixel *dst, const vga_pixel *src, int n) {
+    const int k = sizeof(uint32_t)/sizeof(vga_pixel);
+    src += n;
+    int i = 0;
+    for (; i+k<=n; i+=k) {
+        uint32_t w;
+        src -= k;
+        memcpy((void*)&w, (void*)src, sizeof(w));
+#ifdef BITS12
+        w = (w >> 16) | (w << 16);
+#else
+        w = __builtin_bswap32(w);
+#endif
+        memcpy((void*)&dst[i], (void*)&w, sizeof(w));
+    }
+    for (; i<n; i++) dst[i] = *--src;
+}
+
+// mask of a tile row (bit x) for the row read reversed
+static inline uint32_t mask_hflip(uint32_t m) {
+    m = ((m >> 1) & 0x5555) | ((m & 0x5555) << 1);
+    m = ((m >> 2) & 0x3333) | ((m & 0x3333) << 2);
+    m = ((m >> 4) & 0x0f0f) | ((m & 0x0f0f) << 4);
+    m = ((m >> 8) & 0x00ff) | ((m & 0x00ff) << 8);
+    return m >> (16 - TILES_W);
+}
+
+/*******************************************************************
+ Map cells (16 bits, see TILE_INDEX_MASK):
+ - a vertical flip reads the rows of the tile bottom up
+ - an horizontal flip of an unpacked row costs a reversed copy, a
+   word (4 pixels, 2 with BITS12) at a time: opaque copies reverse
+   the row straight into dst, blends from a reversed line; packed
+   rows are expanded reversed, at the cost of the unflipped ones
+ - transparent layers draw the runs of non 0 pixels of a tile row
+   (tile_rows, one bit per pixel set by tile_check), copied or
+   blended without a test per pixel, an empty row is not fetched
+ - TILE_PRIORITY cells hide the sprites: the line is kept as the
+   layers made it before the sprites, and put back over them where
+   a priority cell has a pixel (not color 0), nothing is composed
+   twice
+*******************************************************************/
+
+// row ty of an unpacked map cell as stored (not reversed if TILE_HFLIP)
+inline const vga_pixel * VGA_T4::GameEngine::tile_row(uint16_t cell, int ty) {
+    int tile = tile_map[cell & TILE_INDEX_MASK];
+    if (cell & TILE_VFLIP) ty = TILES_H - 1 - ty;
+    return &tilesbuffer[(tile_cache.slot[tile]*TILES_H + ty)*TILES_W];
+}
+
+// row ty of a map cell, expanded in line if packed or flipped (color 0 to key_color if keyed)
+inline const vga_pixel * VGA_T4::GameEngine::tile_line(uint16_t cell, int ty, vga_pixel *line, bool keyed) {
+    if (!packed) {
+        const vga_pixel * src = tile_row(cell, ty);
+        if (!(cell & TILE_HFLIP)) return src;
+        copy_hflip(line, src, TILES_W);
+        return line;
+    }
+    int tile = tile_map[cell & TILE_INDEX_MASK];
+    if (cell & TILE_VFLIP) ty = TILES_H - 1 - ty;
+    const unsigned char * src = &((const unsigned char *)tilesbuffer)[(tile_cache.slot[tile]*TILES_H + ty)*(TILES_W/2)];
+    int pal = (tile_pal[tile] + (cell >> TILE_PAL_SHIFT)) & 0xf;
+    const vga_pixel2 * pairs = keyed ? key_pairs[pal] : pal_pairs[pal];
+    if (cell & TILE_HFLIP) expand4_hflip(line, src, TILES_W, pairs);
+    else expand4(line, src, TILES_W, pairs);
+    return line;
+}
+
+// row of a sprite frame in the atlas, expanded in line if packed (frame x and w even, color 0 to key_color)
+inline const vga_pixel * VGA_T4::GameEngine::sprite_line(const Sprite_t *spr, int row, vga_pixel *line) {
+    const Frame_t * f = &frames[spr->index];
+    int pos = (f->y + row)*atlas_w + f->x;
+    if (!packed) return &atlas[pos];
+    expand4(line, &((const unsigned char *)atlas)[pos/2], f->w, key_pairs[spr->palette]);
+    return line;
+}
+
+// Tiles of a layer crossing line y, pixels x1 to x2-1, with x and y scroll
+// (coltab: extra y scroll per map column), if under only the pixels of the
+// TILE_PRIORITY cells, taken from under
+void VGA_T4::GameEngine::compose_tiles(int layer, int y, int xs, int ys, const int16_t *coltab, vga_pixel *dst, int x1, int x2, const vga_pixel *under) {
+    const uint16_t * tilept = &tilesram[layer*TILES_ROWS*TILES_COLS];
+    vga_pixel line[TILES_W];
+
+    // first tile crossing x1
+    int x = x1 - ((x1 + xs) & TILES_HMASK);
+    int col = ((x + xs) >> TILES_HBITS) % TILES_COLS;
+    if (col < 0) col += TILES_COLS;
+
+    int row = ((y + ys) >> TILES_HBITS) % TILES_ROWS;
+    if (row < 0) row += TILES_ROWS;
+    const uint16_t * rowpt = &tilept[row*TILES_COLS];
+    int ty = (y + ys) & TILES_HMASK;
+
+    vga_blend_t mode = layers[layer].mode;
+    int level = layers[layer].level;
+    bool key = (layers[layer].state != LAYER_OPAQUE);
+    bool copy = (!key) && (mode == vga_blend_t::VGA_BLEND_OPAQUE);
+    bool prio = (under != NULL);
+    bool cull = (!prio) && (layer < cull_top);
+    for (; x < x2; x += TILES_W)
+    {
+        uint16_t cell;
+        int cty = ty;
+        if (coltab == NULL) {
+            cell = rowpt[col];
+        }
+        else {
+            int yy = y + ys + coltab[col];
+            int r = (yy >> TILES_HBITS) % TILES_ROWS;
+            if (r < 0) r += TILES_ROWS;
+            cell = tilept[r*TILES_COLS+col];
+            cty = yy & TILES_HMASK;
+        }
+        if (prio && !(cell & TILE_PRIORITY)) {
+            if (++col == TILES_COLS) col = 0;
+            continue;
+        }
+        int col1 = (x < x1) ? x1 - x : 0;
+        int col2 = ((x + TILES_W) > x2) ? x2 - x : TILES_W;
+        if ( cull && covered(layer, y, x+col1, x+col2) ) {
+            if (++col == TILES_COLS) col = 0;
+            continue;
+        }
+        if (key || prio) {
+            // runs of the pixels not 0 between col1 and col2
+            uint32_t m = tile_rows[tile_map[cell & TILE_INDEX_MASK]*TILES_H + ((cell & TILE_VFLIP) ? TILES_H - 1 - cty : cty)];
+            if (cell & TILE_HFLIP) m = mask_hflip(m);
+            m &= ((1u << col2) - 1) & ~((1u << col1) - 1);
+            // opaque runs of an unpacked flipped row are reversed straight from the tile
+            bool flip = (!packed) && (cell & TILE_HFLIP) && (mode == vga_blend_t::VGA_BLEND_OPAQUE);
+            const vga_pixel * src = NULL;
+            if ( (m != 0) && (!prio) ) src = flip ? tile_row(cell, cty) : tile_line(cell, cty, line, false);
+            while (m != 0)
+            {
+                int a = __builtin_ctz(m);
+                int b = a + __builtin_ctz(~(m >> a));
+                m &= ~((1u << b) - 1);
+                if (prio) memcpy((void*)&dst[x+a], (void*)&under[x+a], (b-a)*sizeof(vga_pixel));
+                else if (flip) copy_hflip(&dst[x+a], &src[TILES_W-b], b-a);
+                else if (mode == vga_blend_t::VGA_BLEND_OPAQUE) memcpy((void*)&dst[x+a], (void*)&src[a], (b-a)*sizeof(vga_pixel));
+                else vga_blend_span(&dst[x+a], &src[a], b-a, mode, level, false);
+            }
+            if (++col == TILES_COLS) col = 0;
+            continue;
+        }
+        if ( copy && (!packed) && (cell & TILE_HFLIP) ) {
+            copy_hflip(&dst[x+col1], &tile_row(cell, cty)[TILES_W-col2], col2-col1);
+            if (++col == TILES_COLS) col = 0;
+            continue;
+        }
+        const vga_pixel * src = tile_line(cell, cty, line, false);
+        if (copy) memcpy((void*)&dst[x+col1], (void*)&src[col1], (col2-col1)*sizeof(vga_pixel));
+        else vga_blend_span(&dst[x+col1], &src[col1], col2-col1, mode, level, false);
+        if (++col == TILES_COLS) col = 0;
+    }
+}
+
+// x scroll of a layer on line y (the line table has the fb_height screen lines)
+static inline int layer_xs(const VGA_T4::Layer_t *l, int y) {
+    int row = y >> TILES_HBITS;
+    if ( (row < l->hscr_beg) || (row > l->hscr_end) ) return 0;
+    return ( (l->hscr_tab != NULL) && (y >= 0) && (y < VGA_T4::VGA_Handler::fb_height) ) ? l->hscr + l->hscr_tab[y] : l->hscr;
+}
+
+// Map cell of a (not mode 7) layer shown at screen x,y
+uint16_t VGA_T4::GameEngine::layer_cell(int layer, int x, int y) {
+    Layer_t * l = &layers[layer];
+    int col = ((x + layer_xs(l, y)) >> TILES_HBITS) % TILES_COLS;
+    if (col < 0) col += TILES_COLS;
+    int ys = 0;
+    if ( (x >= (l->vscr_beg << TILES_HBITS)) && (x < ((l->vscr_end + 1) << TILES_HBITS)) ) {
+        ys = (l->vscr_tab != NULL) ? l->vscr + l->vscr_tab[col] : l->vscr;
+    }
+    int row = ((y + ys) >> TILES_HBITS) % TILES_ROWS;
+    if (row < 0) row += TILES_ROWS;
+    return tilesram[(layer*TILES_ROWS + row)*TILES_COLS + col];
+}
 
-    vga_pixel * src=&spritesbuffer[index*SPRITES_W*SPRITES_H];
-    int i,j;
-    vga_pixel pix;
-    for (j=0; j<SPRITES_H; j++)
+// pixels x1 to x2-1 (a tile or less) of line y hidden by opaque tiles of a layer above
+bool VGA_T4::GameEngine::covered(int layer, int y, int x1, int x2) {
+    for (int above=layer+1; above<=cull_top; above++)
     {
-        vga_pixel * dst=&framebuffer[((j+y)*fb_stride)+x];
-        for (i=0; i<SPRITES_W; i++)
+        Layer_t * l = &layers[above];
+        if ( (l->state != LAYER_TRANSPARENT) || (l->mode != vga_blend_t::VGA_BLEND_OPAQUE) || (l->m7_on) ) continue;
+
+        // the cells at both ends, and on both sides of a cell or band edge inside
+        int xs = layer_xs(l, y);
+        int splits[3] = { x1 - ((x1 + xs) & TILES_HMASK) + TILES_W, l->vscr_beg << TILES_HBITS, (l->vscr_end + 1) << TILES_HBITS };
+        bool opaque = tile_opq[tile_map[layer_cell(above, x1, y) & TILE_INDEX_MASK]] && tile_opq[tile_map[layer_cell(above, x2 - 1, y) & TILE_INDEX_MASK]];
+        for (int i=0; (i<3) && opaque; i++)
         {
-            pix=*src++;
-            if ( (!pix) || ((x+i) < 0) || ((x+i) > (fb_width-hscr_mask)) || ((y+j) < 0) || ((y+j) >= fb_height) ) dst++;
-            else *dst++ = pix;
+            if ( (splits[i] > x1) && (splits[i] < x2) ) {
+                opaque = tile_opq[tile_map[layer_cell(above, splits[i] - 1, y) & TILE_INDEX_MASK]] && tile_opq[tile_map[layer_cell(above, splits[i], y) & TILE_INDEX_MASK]];
+            }
         }
+        if (opaque) return true;
+    }
+    return false;
+}
+
+// Layer on line y, pixels x1 to x2-1: x scroll on the rows of the horizontal band,
+// y scroll on the columns of the vertical band
+void VGA_T4::GameEngine::compose_layer(int layer, int y, vga_pixel *dst, int x1, int x2, const vga_pixel *under) {
+    if (layers[layer].state == LAYER_DISABLED) return;
+    if (layers[layer].m7_on) {
+        if (under == NULL) compose_mode7(layer, y, dst, x1, x2);
+        return;
+    }
+    int xs = layer_xs(&layers[layer], y);
+
+    int bx1 = layers[layer].vscr_beg << TILES_HBITS;
+    int bx2 = (layers[layer].vscr_end + 1) << TILES_HBITS;
+    if (bx1 < x1) bx1 = x1;
+    if (bx2 > x2) bx2 = x2;
+    if (bx1 >= bx2) {
+        compose_tiles(layer, y, xs, 0, NULL, dst, x1, x2, under);
+        return;
     }
+    if (x1 < bx1) compose_tiles(layer, y, xs, 0, NULL, dst, x1, bx1, under);
+    compose_tiles(layer, y, xs, layers[layer].vscr, layers[layer].vscr_tab, dst, bx1, bx2, under);
+    if (bx2 < x2) compose_tiles(layer, y, xs, 0, NULL, dst, bx2, x2, under);
 }
 
+// Pixels x1 to x2-1 of line y, dst is the start of the line
+void VGA_T4::GameEngine::compose_span(int y, int x1, int x2, vga_pixel *dst) {
+    // columns beyond xend and lines beyond yend are masked (see set_hscroll, set_vscroll)
+    int yend = (vscr_mask > 0) ? (fb_height - vscr_mask + 1) : fb_height;
+    if (y >= yend) {
+        memset((void*)&dst[x1], 0, (x2-x1)*sizeof(vga_pixel));
+        return;
+    }
+    int xend = (hscr_mask > 0) ? (fb_width - hscr_mask + 1) : fb_width;
+    if (xend > x2) xend = x2;
+
+    if (x1 < xend) {
+        // from the top opaque layer, else from black
+        if (bottom < 0) memset((void*)&dst[x1], 0, (xend-x1)*sizeof(vga_pixel));
+        for (int layer=((bottom < 0) ? 0 : bottom); layer<nb_layers; layer++)
+        {
+            compose_layer(layer, y, dst, x1, xend, NULL);
+        }
+    }
+    if (xend < x2) {
+        int x = (x1 > xend) ? x1 : xend;
+        memset((void*)&dst[x], 0, (x2-x)*sizeof(vga_pixel));
+    }
 
-void VGA_T4::GameEngine::drawTile(unsigned char tile, int x, int y) {
-    vga_pixel * src=&tilesbuffer[tile*TILES_W*TILES_H];
-    int i,j;
-    for (j=0; j<TILES_H; j++)
+    const uint16_t * refs = &band_refs[band_start[y >> TILES_HBITS]];
+    const uint16_t * refsend = &band_refs[band_start[(y >> TILES_HBITS) + 1]];
+    // the layers without the sprites, for the priority cells
+    bool prio = (nb_prio > 0) && (refs < refsend) && (x1 < xend);
+    if (prio) memcpy((void*)&prio_line[x1], (void*)&dst[x1], (xend-x1)*sizeof(vga_pixel));
+    int skip = 0;
+    if (spr_cap > 0) {
+        for (const uint16_t * r = refs; r < refsend; r++)
+        {
+            int row = y - spritesdata[*r].by;
+            if ( (row >= 0) && (row < spritesdata[*r].h) ) skip++;
+        }
+        skip -= spr_cap;
+    }
+    for (; refs < refsend; refs++)
     {
-        vga_pixel * dst=&framebuffer[((j+y)*fb_stride)+x];
-        for (i=0; i<TILES_W; i++)
+        Sprite_t * spr = &spritesdata[*refs];
+        int row = y - spr->by;
+        if ( (row < 0) || (row >= spr->h) ) continue;
+        if (skip > 0) {
+            skip--;
+            continue;
+        }
+        int col1 = (spr->bx < x1) ? x1 - spr->bx : 0;
+        int col2 = ((spr->bx + spr->w) > xend) ? xend - spr->bx : spr->w;
+        if (col1 >= col2) continue;
+        if (spr->xform) {
+            compose_xform(spr, row, col1, col2, &dst[spr->bx]);
+            continue;
+        }
+        vga_pixel line[SPRITES_MAX_W];
+        const vga_pixel * src = sprite_line(spr, row, line);
+        const uint16_t * spans = frames[spr->index].spans;
+        if (spans == NULL) {
+            vga_blend_span_key(&dst[spr->bx+col1], &src[col1], col2-col1, spr->blend, spr->level, key_color);
+            continue;
+        }
+        // opaque runs clipped to col1..col2, no test per pixel
+        vga_pixel * out = &dst[spr->bx];
+        const uint16_t * run = &spans[spans[row]];
+        const uint16_t * runend = &spans[spans[row+1]];
+        for (; run < runend; run += 2)
+        {
+            int a = run[0];
+            int b = a + run[1];
+            if (a < col1) a = col1;
+            if (b > col2) b = col2;
+            if (a >= b) continue;
+            if (spr->blend == vga_blend_t::VGA_BLEND_OPAQUE) memcpy((void*)&out[a], (void*)&src[a], (b-a)*sizeof(vga_pixel));
+            else vga_blend_span(&out[a], &src[a], b-a, spr->blend, spr->level, false);
+        }
+    }
+
+    if (prio) {
+        for (int layer=((bottom < 0) ? 0 : bottom); layer<nb_layers; layer++)
         {
-            *dst++ = *src++;
+            compose_layer(layer, y, dst, x1, xend, prio_line);
         }
     }
 }
 
-void VGA_T4::GameEngine::drawTileCropL(unsigned char tile, int x, int y) {
-    vga_pixel * src=&tilesbuffer[tile*TILES_W*TILES_H];
-    int i,j;
-    vga_pixel pix;
-    for (j=0; j<TILES_H; j++)
+/*******************************************************************
+ Mode 7 layers (layer_affine, layer_mode7):
+ - every screen pixel samples the tile map (repeated) at a map
+   position, a line starts at u,v and steps du,dv per pixel (Q16)
+ - the position is kept inside the map, so a step is 2 adds and
+   2 compares, then the cell and the tile pixel are read
+ - mode7_pixel computes a pixel directly (reference, or to know
+   what is under a screen point)
+*******************************************************************/
+
+#define M7_MAPW ((int64_t)TILES_COLS*TILES_W << 16)
+#define M7_MAPH ((int64_t)TILES_ROWS*TILES_H << 16)
+
+static inline int32_t m7_wrap(int64_t pos, int64_t size) {
+    pos %= size;
+    return (int32_t)((pos < 0) ? pos + size : pos);
+}
+
+// start and steps of line y of a mode 7 layer
+void VGA_T4::GameEngine::mode7_line(int layer, int y, Mode7_t *line) {
+    if (layers[layer].m7_tab != NULL) {
+        *line = layers[layer].m7_tab[y];
+        return;
+    }
+    const int32_t * m = layers[layer].m7_mat;
+    line->u = m7_wrap((int64_t)m[4] + (int64_t)m[1]*y, M7_MAPW);
+    line->v = m7_wrap((int64_t)m[5] + (int64_t)m[3]*y, M7_MAPH);
+    line->du = m[0];
+    line->dv = m[2];
+}
+
+// pixel tx,ty of a map cell (color 0 is key_color if keyed)
+inline vga_pixel VGA_T4::GameEngine::tile_pixel(uint16_t cell, int tx, int ty, bool keyed) {
+    int tile = tile_map[cell & TILE_INDEX_MASK];
+    if (cell & TILE_HFLIP) tx = TILES_W - 1 - tx;
+    if (cell & TILE_VFLIP) ty = TILES_H - 1 - ty;
+    int pos = (tile_cache.slot[tile]*TILES_H + ty)*TILES_W + tx;
+    if (!packed) return tilesbuffer[pos];
+    int pal = (tile_pal[tile] + (cell >> TILE_PAL_SHIFT)) & 0xf;
+    return (keyed ? key_colors : palettes)[pal][(((const unsigned char *)tilesbuffer)[pos >> 1] >> ((pos & 1)*4)) & 0xf];
+}
+
+// Mode 7 layer on line y, pixels x1 to x2-1
+void VGA_T4::GameEngine::compose_mode7(int layer, int y, vga_pixel *dst, int x1, int x2) {
+    const uint16_t * tilept = &tilesram[layer*TILES_ROWS*TILES_COLS];
+    const int32_t mapw = M7_MAPW;
+    const int32_t maph = M7_MAPH;
+    Mode7_t l;
+    mode7_line(layer, y, &l);
+    int32_t u = m7_wrap((int64_t)l.u + (int64_t)l.du*x1, M7_MAPW);
+    int32_t v = m7_wrap((int64_t)l.v + (int64_t)l.dv*x1, M7_MAPH);
+    int32_t du = m7_wrap(l.du, M7_MAPW);
+    int32_t dv = m7_wrap(l.dv, M7_MAPH);
+    bool key = (layers[layer].state != LAYER_OPAQUE);
+    bool copy = (!key) && (layers[layer].mode == vga_blend_t::VGA_BLEND_OPAQUE);
+
+    vga_pixel line[SPRITES_MAX_W];
+    for (int x=x1; x<x2; x+=SPRITES_MAX_W)
     {
-        vga_pixel * dst=&framebuffer[((j+y)*fb_stride)+x];
-        for (i=0; i<TILES_W; i++)
+        int n = ((x2 - x) > SPRITES_MAX_W) ? SPRITES_MAX_W : x2 - x;
+        vga_pixel * out = copy ? &dst[x] : line;
+        for (int i=0; i<n; i++)
         {
-            pix=*src++;
-            if ((x+i) < 0) dst++;
-            else
-                *dst++ = pix;
+            int px = u >> 16;
+            int py = v >> 16;
+            out[i] = tile_pixel(tilept[(py >> TILES_HBITS)*TILES_COLS + (px >> TILES_HBITS)], px & TILES_HMASK, py & TILES_HMASK, key);
+            u += du;
+            if (u >= mapw) u -= mapw;
+            v += dv;
+            if (v >= maph) v -= maph;
         }
+        if (copy) continue;
+        if (key) vga_blend_span_key(&dst[x], line, n, layers[layer].mode, layers[layer].level, key_color);
+        else vga_blend_span(&dst[x], line, n, layers[layer].mode, layers[layer].level, false);
+    }
+}
+
+// Show the tile map of a layer through a matrix: screen x,y shows map pixel
+// u = a*x + b*y + u0, v = c*x + d*y + v0 (Q16, the map repeats)
+void VGA_T4::GameEngine::layer_affine(int layer, int32_t a, int32_t b, int32_t c, int32_t d, int32_t u0, int32_t v0)
+{
+    if ((layer < 0) || (layer >= nb_layers)) return;
+    int32_t * m = layers[layer].m7_mat;
+    m[0] = a;
+    m[1] = b;
+    m[2] = c;
+    m[3] = d;
+    m[4] = u0;
+    m[5] = v0;
+    layers[layer].m7_tab = NULL;
+    layers[layer].m7_on = true;
+    dirty_all = true;
+}
+
+// Same with a start and steps per screen line (fb_height entries, read while composing,
+// perspective floors...), NULL goes back to a scrolled layer
+void VGA_T4::GameEngine::layer_mode7(int layer, const Mode7_t *lines)
+{
+    if ((layer < 0) || (layer >= nb_layers)) return;
+    layers[layer].m7_tab = lines;
+    layers[layer].m7_on = (lines != NULL);
+    dirty_all = true;
+}
+
+// Pixel of a mode 7 layer at screen x,y, computed without stepping
+vga_pixel VGA_T4::GameEngine::mode7_pixel(int layer, int x, int y)
+{
+    if ((layer < 0) || (layer >= nb_layers) || (!layers[layer].m7_on)) return 0;
+    Mode7_t l;
+    mode7_line(layer, y, &l);
+    int px = m7_wrap((int64_t)l.u + (int64_t)l.du*x, M7_MAPW) >> 16;
+    int py = m7_wrap((int64_t)l.v + (int64_t)l.dv*x, M7_MAPH) >> 16;
+    uint16_t cell = tilesram[(layer*TILES_ROWS + (py >> TILES_HBITS))*TILES_COLS + (px >> TILES_HBITS)];
+    return tile_pixel(cell, px & TILES_HMASK, py & TILES_HMASK, false);
+}
+
+/*******************************************************************
+ Transformed sprites (sprite_flip, sprite_affine):
+ - the sprite covers a box around the center of its frame, each
+   pixel of the box is mapped back to the frame (nearest pixel)
+ - flips without rotation fetch the row like an untransformed
+   sprite (reversed for SPRITE_HFLIP), 90 degrees rotations walk a
+   column of the frame, a position steps one atlas row per pixel
+ - affine sprites step the Q16 frame position along the line, the
+   part of the line inside the frame is found first so the loop has
+   no bound check
+ - pixels are gathered SPRITES_MAX_W at a time, then blended with
+   the color key
+*******************************************************************/
+
+// a pixel of the frame of a sprite (color 0 is key_color)
+inline vga_pixel VGA_T4::GameEngine::sprite_pixel(const Sprite_t *spr, int u, int v) {
+    const Frame_t * f = &frames[spr->index];
+    int pos = (f->y + v)*atlas_w + f->x + u;
+    if (!packed) return atlas[pos];
+    return key_colors[spr->palette][(((const unsigned char *)atlas)[pos >> 1] >> ((pos & 1)*4)) & 0xf];
+}
+
+static inline int64_t floordiv(int64_t a, int64_t b) {
+    int64_t q = a / b;
+    if ( ((a % b) != 0) && ((a < 0) != (b < 0)) ) q--;
+    return q;
+}
+
+// narrow k1..k2 (excluded) to the steps k where 0 <= pos + k*step < lim
+static void affine_range(int64_t pos, int64_t step, int64_t lim, int &k1, int &k2) {
+    if (step == 0) {
+        if ( (pos < 0) || (pos >= lim) ) k2 = k1;
+        return;
+    }
+    int64_t lo, hi;
+    if (step > 0) {
+        lo = floordiv(-pos + step - 1, step);
+        hi = floordiv(lim - 1 - pos, step) + 1;
+    }
+    else {
+        lo = floordiv(pos - lim + 1 + (-step) - 1, -step);
+        hi = floordiv(pos, -step) + 1;
     }
+    if (lo > k1) k1 = (lo > k2) ? k2 : (int)lo;
+    if (hi < k2) k2 = (hi < k1) ? k1 : (int)hi;
 }
 
-void VGA_T4::GameEngine::drawTileCropR(unsigned char tile, int x, int y) {
-    vga_pixel * src=&tilesbuffer[tile*TILES_W*TILES_H];
-    int i,j;
-    vga_pixel pix;
-    for (j=0; j<TILES_H; j++)
+// Row of the box of a transformed sprite, columns col1 to col2-1, dst is the box left
+void VGA_T4::GameEngine::compose_xform(const Sprite_t *spr, int row, int col1, int col2, vga_pixel *dst) {
+    const Frame_t * f = &frames[spr->index];
+    vga_pixel line[SPRITES_MAX_W];
+
+    if (spr->xform == SPRITE_XFORM_FLIP) {
+        if (spr->flip & SPRITE_VFLIP) row = spr->h - 1 - row;
+        if (!(spr->flip & SPRITE_ROT90)) {
+            vga_pixel rev[SPRITES_MAX_W];
+            const vga_pixel * src = sprite_line(spr, row, line);
+            if (spr->flip & SPRITE_HFLIP) {
+                copy_hflip(rev, src, f->w);
+                src = rev;
+            }
+            vga_blend_span_key(&dst[col1], &src[col1], col2-col1, spr->blend, spr->level, key_color);
+            return;
+        }
+        // column row of the frame, bottom up (top down if SPRITE_HFLIP)
+        int step = (spr->flip & SPRITE_HFLIP) ? atlas_w : -atlas_w;
+        int pos = (f->y + ((spr->flip & SPRITE_HFLIP) ? col1 : f->h - 1 - col1))*atlas_w + f->x + row;
+        for (int x=col1; x<col2; x+=SPRITES_MAX_W)
+        {
+            int n = ((col2 - x) > SPRITES_MAX_W) ? SPRITES_MAX_W : col2 - x;
+            if (!packed) {
+                const vga_pixel * src = &atlas[pos];
+                for (int i=0; i<n; i++)
+                {
+                    line[i] = *src;
+                    src += step;
+                }
+                pos += n*step;
+            }
+            else {
+                const unsigned char * bytes = (const unsigned char *)atlas;
+                const vga_pixel * colors = key_colors[spr->palette];
+                for (int i=0; i<n; i++)
+                {
+                    line[i] = colors[(bytes[pos >> 1] >> ((pos & 1)*4)) & 0xf];
+                    pos += step;
+                }
+            }
+            vga_blend_span_key(&dst[x], line, n, spr->blend, spr->level, key_color);
+        }
+        return;
+    }
+
+    // frame position (Q16) of the center of pixel col1, the frame center is at the box center
+    int64_t sx = ((int64_t)(spr->bx + col1 - spr->x) << 16) + 0x8000 - ((int64_t)f->w << 15);
+    int64_t sy = ((int64_t)(spr->by + row - spr->y) << 16) + 0x8000 - ((int64_t)f->h << 15);
+    int64_t u = ((spr->pa*sx + spr->pb*sy) >> 16) + ((int64_t)f->w << 15);
+    int64_t v = ((spr->pc*sx + spr->pd*sy) >> 16) + ((int64_t)f->h << 15);
+    int k1 = 0;
+    int k2 = col2 - col1;
+    affine_range(u, spr->pa, (int64_t)f->w << 16, k1, k2);
+    affine_range(v, spr->pc, (int64_t)f->h << 16, k1, k2);
+    int32_t uu = u + (int64_t)k1*spr->pa;
+    int32_t vv = v + (int64_t)k1*spr->pc;
+    for (int x=col1+k1; x<col1+k2; x+=SPRITES_MAX_W)
     {
-        vga_pixel * dst=&framebuffer[((j+y)*fb_stride)+x];
-        for (i=0; i<TILES_W; i++)
+        int n = ((col1 + k2 - x) > SPRITES_MAX_W) ? SPRITES_MAX_W : col1 + k2 - x;
+        for (int i=0; i<n; i++)
         {
-            pix = *src++;
-            if ((x+i) > (fb_width-hscr_mask)) *dst++=0;
-            else
-                *dst++ = pix;
+            line[i] = sprite_pixel(spr, uu >> 16, vv >> 16);
+            uu += spr->pa;
+            vv += spr->pc;
         }
+        vga_blend_span_key(&dst[x], line, n, spr->blend, spr->level, key_color);
     }
 }
 
-void VGA_T4::GameEngine::drawTransTile(unsigned char tile, int x, int y) {
-    vga_pixel * src=&tilesbuffer[tile*TILES_W*TILES_H];
-    vga_pixel pix;
-    int i,j;
-    for (j=0; j<TILES_H; j++)
+/*******************************************************************
+ Dirty cells:
+ - the screen is divided in TILES_W x TILES_H cells, a bit per cell
+ - tile changes, scroll changes and sprite changes (old and new
+   position) mark cells, run_gfxengine only recomposes the marked
+   cells in the frame buffer (the background under a sprite is
+   restored by recomposing it)
+*******************************************************************/
+
+void VGA_T4::GameEngine::mark_rect(int x, int y, int w, int h) {
+    if (x < 0) {
+        w += x;
+        x = 0;
+    }
+    if (y < 0) {
+        h += y;
+        y = 0;
+    }
+    if ((x + w) > fb_width) w = fb_width - x;
+    if ((y + h) > fb_height) h = fb_height - y;
+    if ((w <= 0) || (h <= 0)) return;
+
+    int cx2 = (x + w - 1) >> TILES_HBITS;
+    int cy2 = (y + h - 1) >> TILES_HBITS;
+    for (int cy = y >> TILES_HBITS; cy <= cy2; cy++)
     {
-        vga_pixel * dst=&framebuffer[((j+y)*fb_stride)+x];
-        for (i=0; i<TILES_W; i++)
+        for (int cx = x >> TILES_HBITS; cx <= cx2; cx++)
         {
-            if ((pix=*src++)) *dst++ = pix;
-            else dst++;
+            dirty[cy][cx >> 5] |= (1u << (cx & 31));
         }
     }
 }
 
-void VGA_T4::GameEngine::drawTransTileCropL(unsigned char tile, int x, int y) {
-    vga_pixel * src=&tilesbuffer[tile*TILES_W*TILES_H];
-    vga_pixel pix;
-    int i,j;
-    for (j=0; j<TILES_H; j++)
+// every place a map cell of a layer is shown, scrolled or not (the map repeats beyond its size)
+void VGA_T4::GameEngine::mark_cell(int layer, int col, int row) {
+    int mapw = TILES_COLS*TILES_W;
+    int maph = TILES_ROWS*TILES_H;
+    for (int i=0; i<4; i++)
     {
-        vga_pixel * dst=&framebuffer[((j+y)*fb_stride)+x];
-        for (i=0; i<TILES_W; i++)
+        int x = ((col << TILES_HBITS) - ((i & 1) ? layers[layer].hscr : 0)) % mapw;
+        int y = ((row << TILES_HBITS) - ((i & 2) ? layers[layer].vscr : 0)) % maph;
+        if (x < 0) x += mapw;
+        if (y < 0) y += maph;
+        for (int py = y - maph; py < fb_height; py += maph)
         {
-            pix=*src++;
-            if ((x+i) < 0) dst++;
-            else
-            if (pix) *dst++ = pix;
-            else dst++;
+            for (int px = x - mapw; px < fb_width; px += mapw) mark_rect(px, py, TILES_W, TILES_H);
         }
     }
 }
 
-void VGA_T4::GameEngine::drawTransTileCropR(unsigned char tile, int x, int y) {
-    vga_pixel * src=&tilesbuffer[tile*TILES_W*TILES_H];
-    vga_pixel pix;
-    int i,j;
-    for (j=0; j<TILES_H; j++)
+// every map cell using a tile, or showing it through an animation
+void VGA_T4::GameEngine::mark_tile(int index) {
+    for (int layer=0; layer<nb_layers; layer++)
     {
-        vga_pixel * dst=&framebuffer[((j+y)*fb_stride)+x];
-        for (i=0; i<TILES_W; i++)
+        const uint16_t * tilept = &tilesram[layer*TILES_ROWS*TILES_COLS];
+        for (int i=0; i<TILES_ROWS*TILES_COLS; i++)
         {
-            if ((x+i) > (fb_width-hscr_mask)) src++;
-            else
-            if ((pix=*src++)) *dst++ = pix;
-            else *dst++;
+            int tile = tilept[i] & TILE_INDEX_MASK;
+            if ((tile == index) || (tile_map[tile] == index)) mark_cell(layer, i % TILES_COLS, i / TILES_COLS);
         }
     }
 }
 
+void VGA_T4::GameEngine::mark_sprite(int id) {
+    Sprite_t * spr = &spritesdata[id];
+    if (spr->slot >= 0) mark_rect(spr->bx, spr->by, spr->w, spr->h);
+}
 
+// redraw everything at next run_gfxengine (after drawing over the engine)
+void VGA_T4::GameEngine::invalidate() {
+    dirty_all = true;
+}
 
-void VGA_T4::GameEngine::tileText(unsigned char index, int16_t x, int16_t y, const char * text, vga_pixel fgcolor, vga_pixel bgcolor, vga_pixel *dstbuffer, int dstwidth, int dstheight) {
-    vga_pixel c;
-    vga_pixel * dst;
 
-    while ((c = *text++)) {
-        const unsigned char * charpt=&font8x8[c][0];
-        int l=y;
-        for (int i=0;i<8;i++)
-        {
-            unsigned char bits;
-            dst=&dstbuffer[(index*dstheight+l)*dstwidth+x];
-            bits = *charpt++;
-            if (bits&0x01) *dst++=fgcolor;
-            else *dst++=bgcolor;
-            bits = bits >> 1;
-            if (bits&0x01) *dst++=fgcolor;
-            else *dst++=bgcolor;
-            bits = bits >> 1;
-            if (bits&0x01) *dst++=fgcolor;
-            else *dst++=bgcolor;
-            bits = bits >> 1;
-            if (bits&0x01) *dst++=fgcolor;
-            else *dst++=bgcolor;
-            bits = bits >> 1;
-            if (bits&0x01) *dst++=fgcolor;
-            else *dst++=bgcolor;
-            bits = bits >> 1;
-            if (bits&0x01) *dst++=fgcolor;
-            else *dst++=bgcolor;
-            bits = bits >> 1;
-            if (bits&0x01) *dst++=fgcolor;
-            else *dst++=bgcolor;
-            bits = bits >> 1;
-            if (bits&0x01) *dst++=fgcolor;
-            else *dst++=bgcolor;
-            l++;
-        }
-        x +=8;
-    }
-}
-
-void VGA_T4::GameEngine::tileTextOverlay(int16_t x, int16_t y, const char * text, vga_pixel fgcolor) {
-    vga_pixel c;
-    vga_pixel * dst;
-
-    while ((c = *text++)) {
-        const unsigned char * charpt=&font8x8[c][0];
-        int l=y;
-        for (int i=0;i<8;i++)
+/*******************************************************************
+ World maps:
+ - a layer can show a map of any size, in memory (flash) or read
+   through a callback (SD...)
+ - the tile map is a ring cache of the world around the camera
+   (the scroll of the layer): world cell c,r lives in map cell
+   c % TILES_COLS, r % TILES_ROWS
+ - when the camera moves, the entering columns and rows are loaded,
+   at most world_stream() lines per frame
+*******************************************************************/
+
+// load a world column (vertical) or row into the tile map, cells outside the world are 0
+void VGA_T4::GameEngine::world_load(int layer, int wcol, int wrow, bool vertical) {
+    uint16_t cells[(TILES_COLS > TILES_ROWS) ? TILES_COLS : TILES_ROWS];
+    World_t * w = &layers[layer].world;
+    int len = vertical ? TILES_ROWS : TILES_COLS;
+    int pos = vertical ? wrow : wcol;
+    int size = vertical ? w->height : w->width;
+    int other = vertical ? wcol : wrow;
+    int othersize = vertical ? w->width : w->height;
+
+    memset((void*)cells, 0, sizeof(cells));
+    int beg = (pos < 0) ? -pos : 0;
+    int end = ((pos + len) > size) ? size - pos : len;
+    if ( (other >= 0) && (other < othersize) && (beg < end) ) {
+        if (w->reader != NULL) {
+            if (vertical) w->reader(layer, wcol, wrow + beg, end - beg, true, &cells[beg]);
+            else w->reader(layer, wcol + beg, wrow, end - beg, false, &cells[beg]);
+        }
+        else {
+            int pos = wcol*w->colstep + wrow*w->rowstep;
+            int step = vertical ? w->rowstep : w->colstep;
+            if (w->cells != NULL) {
+                for (int i=beg; i<end; i++) cells[i] = w->cells[pos + i*step];
+            }
+            else {
+                for (int i=beg; i<end; i++) cells[i] = w->data[pos + i*step];
+            }
+        }
+    }
+
+    for (int i=0; i<len; i++)
+    {
+        int c = (vertical ? wcol : wcol + i) % TILES_COLS;
+        int r = (vertical ? wrow + i : wrow) % TILES_ROWS;
+        if (c < 0) c += TILES_COLS;
+        if (r < 0) r += TILES_ROWS;
+        tile_draw(layer, c, r, cells[i]);
+    }
+}
+
+// move the cached windows toward the cameras, loading at most budget lines
+void VGA_T4::GameEngine::world_update(int budget) {
+    for (int layer=0; layer<nb_layers; layer++)
+    {
+        World_t * w = &layers[layer].world;
+        if (!w->on) continue;
+        int tcol = layers[layer].hscr >> TILES_HBITS;
+        int trow = layers[layer].vscr >> TILES_HBITS;
+        if ( (abs(tcol - w->col) >= TILES_COLS) || (abs(trow - w->row) >= TILES_ROWS) ) {
+            // too far: reload all columns
+            w->col = tcol - TILES_COLS;
+            w->row = trow;
+        }
+        while (budget > 0)
         {
-            unsigned char bits;
-            dst=&framebuffer[+l*fb_stride+x];
-            bits = *charpt++;
-            if (bits&0x01) *dst++=fgcolor;
-            else dst++;
-            bits = bits >> 1;
-            if (bits&0x01) *dst++=fgcolor;
-            else dst++;
-            bits = bits >> 1;
-            if (bits&0x01) *dst++=fgcolor;
-            else dst++;
-            bits = bits >> 1;
-            if (bits&0x01) *dst++=fgcolor;
-            else dst++;
-            bits = bits >> 1;
-            if (bits&0x01) *dst++=fgcolor;
-            else dst++;
-            bits = bits >> 1;
-            if (bits&0x01) *dst++=fgcolor;
-            else dst++;
-            bits = bits >> 1;
-            if (bits&0x01) *dst++=fgcolor;
-            else dst++;
-            bits = bits >> 1;
-            if (bits&0x01) *dst++=fgcolor;
-            else dst++;
-            l++;
-        }
-        x +=8;
+            if (w->col < tcol) {
+                world_load(layer, w->col + TILES_COLS, w->row, true);
+                w->col++;
+            }
+            else if (w->col > tcol) {
+                w->col--;
+                world_load(layer, w->col, w->row, true);
+            }
+            else if (w->row < trow) {
+                world_load(layer, w->col, w->row + TILES_ROWS, false);
+                w->row++;
+            }
+            else if (w->row > trow) {
+                w->row--;
+                world_load(layer, w->col, w->row, false);
+            }
+            else break;
+            budget--;
+        }
+    }
+}
+
+void VGA_T4::GameEngine::world_attach(int layer, int width, int height, bool colmajor) {
+    World_t * w = &layers[layer].world;
+    w->width = width;
+    w->height = height;
+    w->colstep = colmajor ? height : 1;
+    w->rowstep = colmajor ? 1 : width;
+    w->col = (layers[layer].hscr >> TILES_HBITS) - TILES_COLS;
+    w->row = layers[layer].vscr >> TILES_HBITS;
+    w->on = true;
+
+    // the last cached column and row cannot be shown with the first one
+    int hmask = fb_width - (TILES_COLS-1)*TILES_W + 1;
+    int vmask = fb_height - (TILES_ROWS-1)*TILES_H + 1;
+    if (hscr_mask < hmask) hscr_mask = hmask;
+    if (vscr_mask < vmask) vscr_mask = vmask;
+    dirty_all = true;
+
+    world_update(TILES_COLS*nb_layers);
+}
+
+// Show a world map of width x height cells (row after row, or column after column if colmajor)
+// on a layer, the map is read in place (flash or RAM)
+void VGA_T4::GameEngine::world_map(int layer, const unsigned char *map, int width, int height, bool colmajor)
+{
+    if ((layer < 0) || (layer >= nb_layers)) return;
+    World_t * w = &layers[layer].world;
+    w->data = map;
+    w->cells = NULL;
+    w->reader = NULL;
+    world_attach(layer, width, height, colmajor);
+}
+
+// Same with 16 bits cells (see TILE_INDEX_MASK)
+void VGA_T4::GameEngine::world_map(int layer, const uint16_t *map, int width, int height, bool colmajor)
+{
+    if ((layer < 0) || (layer >= nb_layers)) return;
+    World_t * w = &layers[layer].world;
+    w->data = NULL;
+    w->cells = map;
+    w->reader = NULL;
+    world_attach(layer, width, height, colmajor);
+}
+
+// Show a world map of width x height cells read through a callback, NULL detaches the world
+void VGA_T4::GameEngine::world_reader(int layer, world_reader_t reader, int width, int height)
+{
+    if ((layer < 0) || (layer >= nb_layers)) return;
+    World_t * w = &layers[layer].world;
+    if (reader == NULL) {
+        w->on = false;
+        return;
     }
+    w->data = NULL;
+    w->cells = NULL;
+    w->reader = reader;
+    world_attach(layer, width, height, false);
 }
 
+// Columns and rows loaded per frame by run_gfxengine (all layers)
+void VGA_T4::GameEngine::world_stream(int lines)
+{
+    world_lines = lines;
+}
+
+// Top left world pixel shown by a layer
+void VGA_T4::GameEngine::camera(int layer, int x, int y)
+{
+    hscroll(layer, x);
+    vscroll(layer, y);
+}
 
 
 //############################################################################################################# start propper functions
 static const char * hex = "0123456789ABCDEF";
 
-void VGA_T4::GameEngine::begin_gfxengine(int nblayers, int nbtiles, int nbsprites)
+void VGA_T4::GameEngine::begin_gfxengine(int nblayers, int nbtiles, int nbsprites, bool packedgfx)
 {
     nb_layers = nblayers;
     nb_tiles = nbtiles;
     nb_sprites = nbsprites;
+    tile_slots = nbtiles;
+    sprite_slots = nbsprites;
+    packed = packedgfx;
+    tile_size = packed ? (TILES_W*TILES_H/2) : (TILES_W*TILES_H*sizeof(vga_pixel));
+    sprite_size = packed ? (SPRITES_W*SPRITES_H/2) : (SPRITES_W*SPRITES_H*sizeof(vga_pixel));
+
+    if (spritesbuffer == NULL) spritesbuffer = (vga_pixel*)vga_alloc(sprite_size*nb_sprites, GE_REGION);
+    if (tilesbuffer == NULL) tilesbuffer = (vga_pixel*)vga_alloc(tile_size*nb_tiles, GE_REGION);
+    if (tilesram == NULL) tilesram = (uint16_t *)vga_alloc(TILES_COLS*TILES_ROWS*nb_layers*sizeof(uint16_t), GE_REGION);
+    if (spritesdata == NULL) spritesdata = (VGA_T4::Sprite_t *)vga_alloc(SPRITES_MAX*sizeof(Sprite_t), GE_REGION);
+    if (frames == NULL) {
+        frames = (VGA_T4::Frame_t *)vga_alloc(nb_sprites*sizeof(Frame_t), GE_REGION);
+        memset((void*)frames,0,nb_sprites*sizeof(Frame_t));
+    }
+    if (tile_pal == NULL) tile_pal = (unsigned char *)vga_alloc(nb_tiles, GE_REGION);
+    if (tile_opq == NULL) tile_opq = (unsigned char *)vga_alloc(nb_tiles, GE_REGION);
+    if (tile_rows == NULL) tile_rows = (uint16_t *)vga_alloc(nb_tiles*TILES_H*sizeof(uint16_t), GE_REGION);
+    if (tile_map == NULL) tile_map = (uint16_t *)vga_alloc(nb_tiles*sizeof(uint16_t), GE_REGION);
+    if (tile_mark == NULL) tile_mark = (unsigned char *)vga_alloc(nb_tiles, GE_REGION);
+    if (tile_cache.slot == NULL) tile_cache.slot = (uint16_t *)vga_alloc(nb_tiles*sizeof(uint16_t), GE_REGION);
+    if (layers == NULL) layers = (VGA_T4::Layer_t *)vga_alloc(nb_layers*sizeof(Layer_t), GE_REGION);
+    // pixel pairs of the palettes, only packed bytes are expanded with them
+    if (packed) {
+        if (pal_pairs == NULL) pal_pairs = (vga_pixel2 (*)[256])vga_alloc(16*256*sizeof(vga_pixel2), GE_REGION);
+        if (key_pairs == NULL) key_pairs = (vga_pixel2 (*)[256])vga_alloc(16*256*sizeof(vga_pixel2), GE_REGION);
+    }
+    else {
+        vga_free(key_pairs, GE_REGION);
+        vga_free(pal_pairs, GE_REGION);
+        key_pairs = NULL;
+        pal_pairs = NULL;
+    }
+
+    memset((void*)spritesbuffer,0, sprite_size*nb_sprites);
+    memset((void*)tilesbuffer,0, tile_size*nb_tiles);
+    memset((void*)tilesram,0,TILES_COLS*TILES_ROWS*nb_layers*sizeof(uint16_t));
+    memset((void*)spritesdata,0,SPRITES_MAX*sizeof(Sprite_t));
+    memset((void*)tile_pal,0,nb_tiles);
+    memset((void*)tile_opq,0,nb_tiles);
+    memset((void*)tile_rows,0,nb_tiles*TILES_H*sizeof(uint16_t));
+    memset((void*)tile_mark,0,nb_tiles);
+    for (int i=0; i<nb_tiles; i++) tile_map[i] = i;
+    for (int i=0; i<nb_tiles; i++) tile_cache.slot[i] = i;
+    nb_anims = 0;
+    nb_cycles = 0;
+    anim_valid = false;
+    pal_mark = 0;
+    memset((void*)layers,0,nb_layers*sizeof(Layer_t));
+    for (int l=0; l<nb_layers; l++)
+    {
+        layers[l].hscr_end = GE_CELLS_Y-1;
+        layers[l].vscr_end = GE_CELLS_X-1;
+        layers[l].mode = vga_blend_t::VGA_BLEND_OPAQUE;
+        layers[l].level = AA_LEVELS;
+        layers[l].state = (l == 0) ? LAYER_OPAQUE : LAYER_TRANSPARENT;
+    }
+    nb_opq = 0;
+    nb_prio = 0;
+    dirty_all = true;
+    for (int i=0; i<SPRITES_MAX; i++)
+    {
+        spritesdata[i].slot = -1;
+        spritesdata[i].blend = vga_blend_t::VGA_BLEND_OPAQUE;
+        spritesdata[i].level = AA_LEVELS;
+    }
+    spr_nactive = 0;
+    for (int i=0; i<=COLL_BUCKETS; i++) coll_head[i] = -1;
+    if (tile_flags == NULL) tile_flags = (unsigned char *)vga_alloc(nb_tiles, GE_REGION);
+    memset((void*)tile_flags,0,nb_tiles);
 
-    if (spritesbuffer == NULL) spritesbuffer = (vga_pixel*)malloc(SPRITES_W*SPRITES_H*sizeof(vga_pixel)*nb_sprites);
-    if (tilesbuffer == NULL) tilesbuffer = (vga_pixel*)malloc(TILES_W*TILES_H*sizeof(vga_pixel)*nb_tiles);
-    if (tilesram == NULL) tilesram = (unsigned char *)malloc(TILES_COLS*TILES_ROWS*nb_layers);
-    if (spritesdata == NULL) spritesdata = (VGA_T4::Sprite_t *)malloc(SPRITES_MAX*sizeof(Sprite_t));
+    // default atlas: the sprite definitions one below the other
+    atlas = spritesbuffer;
+    atlas_w = SPRITES_W;
+    for (int i=0; i<nb_sprites; i++)
+    {
+        frame_changed(i);
+        frames[i].x = 0;
+        frames[i].y = i*SPRITES_H;
+        frames[i].w = SPRITES_W;
+        frames[i].h = SPRITES_H;
+    }
 
-    memset((void*)spritesbuffer,0, SPRITES_W*SPRITES_H*sizeof(vga_pixel)*nb_sprites);
-    memset((void*)tilesbuffer,0, TILES_W*TILES_H*sizeof(vga_pixel)*nb_tiles);
-    memset((void*)tilesram,0,TILES_COLS*TILES_ROWS*nb_layers);
+    // gray ramp in every palette
+    vga_pixel ramp[16];
+    for (int i=0; i<16; i++) ramp[i] = VGA_RGB(i*17,i*17,i*17);
+    for (int i=0; i<16; i++) memcpy((void*)palettes[i], (void*)ramp, sizeof(ramp));
+    key_color = 0;
+    key_update();
+    for (int i=0; i<16; i++) set_palette(i, ramp);
 
-    /* Random test tiles */
+    /* Random test tiles, numbered (drawn with the primitives) */
+    Surface screen = getTarget();
     char numhex[3];
-    for (int i=0; i<nb_tiles; i++)
+    unsigned char * tiles = (unsigned char *)tilesbuffer;
+    for (int i=1; i<nb_tiles; i++)
     {
         int r = random(0x40,0xff);
         int g = random(0x40,0xff);
         int b = random(0x40,0xff);
-        if (i==0) {
-            memset((void*)&tilesbuffer[TILES_W*TILES_H*sizeof(vga_pixel)*i],0, TILES_W*TILES_H*sizeof(vga_pixel));
+        if (packed) {
+            memset((void*)&tiles[tile_size*i], (i & 0xf)*0x11, tile_size);
         }
         else {
-            memset((void*)&tilesbuffer[TILES_W*TILES_H*sizeof(vga_pixel)*i],VGA_RGB(r,g,b), TILES_W*TILES_H*sizeof(vga_pixel));
+            memset((void*)&tiles[tile_size*i],VGA_RGB(r,g,b), tile_size);
             numhex[0] = hex[(i>>4) & 0xf];
             numhex[1] = hex[i & 0xf];
             numhex[2] = 0;
-            if (TILES_W == 16 )tileText(i, 0, 0, numhex, VGA_RGB(0xff,0xff,0xff), VGA_RGB(0x40,0x40,0x40), tilesbuffer,TILES_W,TILES_H);
+            if (TILES_W == 16 ) {
+                Surface tile = { &tilesbuffer[i*TILES_W*TILES_H], TILES_W, TILES_H, TILES_W, 0, 0 };
+                setTarget(tile);
+                drawText(0, 0, numhex, VGA_RGB(0xff,0xff,0xff), VGA_RGB(0x40,0x40,0x40), false);
+            }
         }
+        tile_check(i);
     }
     /* Random test sprites */
-    for (int i=0; i<nb_sprites; i++)
+    unsigned char * sprites = (unsigned char *)spritesbuffer;
+    for (int i=1; i<nb_sprites; i++)
     {
         int r = random(0x40,0xff);
         int g = random(0x40,0xff);
         int b = random(0x40,0xff);
-        if (i==0) {
-            memset((void*)&spritesbuffer[SPRITES_W*SPRITES_H*sizeof(vga_pixel)*i],0, SPRITES_W*SPRITES_H*sizeof(vga_pixel));
+        if (packed) {
+            memset((void*)&sprites[sprite_size*i], (i & 0xf)*0x11, sprite_size);
         }
         else {
-            memset((void*)&spritesbuffer[SPRITES_W*SPRITES_H*sizeof(vga_pixel)*i],VGA_RGB(r,g,b), SPRITES_W*SPRITES_H*sizeof(vga_pixel));
+            memset((void*)&sprites[sprite_size*i],VGA_RGB(r,g,b), sprite_size);
             numhex[0] = hex[(i>>4) & 0xf];
             numhex[1] = hex[i & 0xf];
             numhex[2] = 0;
-            tileText(i, 0, 0, numhex, VGA_RGB(0xff,0xff,0x00), VGA_RGB(0x00,0x00,0x00),spritesbuffer,SPRITES_W,SPRITES_H);
+            Surface sprite = { &spritesbuffer[i*SPRITES_W*SPRITES_H], SPRITES_W, SPRITES_H, SPRITES_W, 0, 0 };
+            setTarget(sprite);
+            drawText(0, 0, numhex, VGA_RGB(0xff,0xff,0x00), VGA_RGB(0x00,0x00,0x00), false);
         }
     }
+    setTarget(screen);
 }
 
 
 void VGA_T4::GameEngine::run_gfxengine()
 {
-    waitLine(480+40);
+    // begin(mode, false) without linemode(): nowhere to compose
+    if ( (ring == NULL) && (framebuffer == NULL) ) return;
 
-    unsigned char * tilept;
+    int visbeg = TOP_BORDER + (fb_top << line_double);
+    int visend = visbeg + (fb_height << line_double);
+    world_update(world_lines);
+    waitLine(visend);
 
-    // Layer 0
-    for (int j=0; j<TILES_ROWS; j++)
+    collect_sprites();
+
+    // scroll tables can change anytime
+    for (int layer=0; layer<nb_layers; layer++)
     {
-        tilept = &tilesram[j*TILES_COLS];
-        if ( (j>=hscr_beg[0]) && (j<=hscr_end[0]) ) {
-            int modcol = (hscr[0] >> TILES_HBITS) % TILES_COLS;
-            for (int i=0; i<TILES_COLS; i++)
-            {
-                (i == 0) ? drawTileCropL(tilept[modcol], (i<<TILES_HBITS) - (hscr[0] & TILES_HMASK), j*TILES_H) :
-                (i == (TILES_COLS-1))?drawTileCropR(tilept[modcol], (i<<TILES_HBITS) - (hscr[0] & TILES_HMASK), j*TILES_H) :
-                drawTile(tilept[modcol], (i<<TILES_HBITS) - (hscr[0] & TILES_HMASK), j*TILES_H);
-                modcol++;
-                modcol = modcol % TILES_COLS;
-            }
-        }
-        else {
-            for (int i=0; i<TILES_COLS; i++)
-            {
-                (i == (TILES_COLS-1)) ? drawTileCropR(tilept[i], (i<<TILES_HBITS), j*TILES_H) :
-                drawTile(tilept[i], (i<<TILES_HBITS), j*TILES_H);
-            }
-        }
+        if ((layers[layer].hscr_tab != NULL) || (layers[layer].vscr_tab != NULL) || (layers[layer].m7_on)) dirty_all = true;
     }
+    anim_step();
+    assets_update();
 
-    // Other layers
-    if (nb_layers > 1) {
-        int lcount = 1;
-        while (lcount < nb_layers) {
-            for (int j=0; j<TILES_ROWS; j++)
+    // layers below the top opaque one are not drawn, transparent layers above it may hide tiles below
+    bottom = -1;
+    cull_top = -1;
+    for (int layer=0; layer<nb_layers; layer++)
+    {
+        Layer_t * l = &layers[layer];
+        if (l->mode != vga_blend_t::VGA_BLEND_OPAQUE) continue;
+        if (l->state == LAYER_OPAQUE) bottom = layer;
+        else if ( (l->state == LAYER_TRANSPARENT) && (!l->m7_on) && (nb_opq > 0) ) cull_top = layer;
+    }
+
+    if (ring == NULL) {
+        // vertical blank is shorter than a frame redraw, but the cells are composed
+        // top to bottom ahead of the beam
+        int cols = (fb_width + TILES_W - 1) >> TILES_HBITS;
+        for (int cy=0; (cy << TILES_HBITS) < fb_height; cy++)
+        {
+            uint32_t * bits = dirty[cy];
+            int y1 = cy << TILES_HBITS;
+            int y2 = ((y1 + TILES_H) > fb_height) ? fb_height : y1 + TILES_H;
+            int cx = 0;
+            while (cx < cols)
             {
-                tilept = &tilesram[(j+lcount*TILES_ROWS)*TILES_COLS];
-                if ( (j>=hscr_beg[lcount]) && (j<=hscr_end[lcount]) ) {
-                    int modcol = (hscr[lcount] >> TILES_HBITS) % TILES_COLS;
-                    for (int i=0; i<TILES_COLS; i++)
-                    {
-                        (i == 0) ? drawTransTileCropL(tilept[modcol], (i<<TILES_HBITS) - (hscr[lcount] & TILES_HMASK), j*TILES_H) :
-                        (i == (TILES_COLS-1))?drawTransTileCropR(tilept[modcol], (i<<TILES_HBITS) - (hscr[lcount] & TILES_HMASK), j*TILES_H) :
-                        drawTransTile(tilept[modcol], (i<<TILES_HBITS) - (hscr[lcount] & TILES_HMASK), j*TILES_H);
-                        modcol++;
-                        modcol = modcol % TILES_COLS;
-                    }
+                if ( (!dirty_all) && (!(bits[cx >> 5] & (1u << (cx & 31)))) ) {
+                    cx = (bits[cx >> 5] >> (cx & 31)) ? cx + 1 : (cx | 31) + 1;
+                    continue;
                 }
-                else {
-                    for (int i=0; i<TILES_COLS; i++)
-                    {
-                        drawTransTile(tilept[i], (i<<TILES_HBITS), j*TILES_H);
-                    }
+                // run of dirty cells
+                int cx2 = cx + 1;
+                while ( (cx2 < cols) && ((dirty_all) || (bits[cx2 >> 5] & (1u << (cx2 & 31)))) ) cx2++;
+                int x1 = cx << TILES_HBITS;
+                int x2 = ((cx2 << TILES_HBITS) > fb_width) ? fb_width : (cx2 << TILES_HBITS);
+                for (int y=y1; y<y2; y++)
+                {
+                    compose_span(y, x1, x2, &framebuffer[y*fb_stride]);
                 }
+                cx = cx2;
             }
-            lcount++;
         }
+        memset((void*)dirty, 0, sizeof(dirty));
+        dirty_all = false;
+        return;
     }
 
-/*
- static char * ro="01234567890123456789012345678901234567";
- for (int i=0; i<TILES_ROWS*2; i++)
- {
-  tileTextOverlay(0, i*8, ro, VGA_RGB(0x00,0xff,0x00));
- }
-*/
-
-    for (int i=0; i<SPRITES_MAX; i++)
+    for (int y=0; y<fb_height; y++)
     {
-        drawSpr(spritesdata[i].index, spritesdata[i].x, spritesdata[i].y);
+        // ring line of y is free once the beam has left line y-ring_lines; outside the
+        // picture (vertical blank, or the next frame when late) no line of it is done
+        int done;
+        do {
+            int line = getLine();
+            done = ( (line >= visbeg) && (line < visend) ) ? ((line - visbeg) >> line_double) - 1 : -1;
+        } while (y >= done + 1 + ring_lines);
+        compose_span(y, 0, fb_width, &ring[(y & (ring_lines-1))*fb_stride + left_border]);
+    }
+    memset((void*)dirty, 0, sizeof(dirty));
+    dirty_all = true;
+}
+
+// Compose lines into a ring of nblines lines (power of 2) scanned out instead of the frame
+// buffer, which is then not needed (begin(mode, false)). 0 goes back to the frame buffer.
+vga_error_t VGA_T4::GameEngine::linemode(int nblines)
+{
+    setLineRing(NULL, 0);
+    dirty_all = true;
+    if (ring != NULL) {
+        vga_free(ring_alloc, FB_REGION);
+        ring_alloc = NULL;
+        ring = NULL;
+        ring_lines = 0;
     }
+    if (nblines <= 0) return(vga_error_t::VGA_OK);
+    if (nblines & (nblines-1)) return(vga_error_t::VGA_ERROR);
+
+    // scroll pad on both sides, like the frame buffer
+    int pad = scrollPad();
+    ring_alloc = (vga_pixel*)vga_alloc((nblines*fb_stride + 2*pad)*sizeof(vga_pixel)+4, FB_REGION); // 4bytes for pixel shift
+    if (ring_alloc == NULL) return(vga_error_t::VGA_ERROR);
+    memset((void*)ring_alloc, 0, (nblines*fb_stride + 2*pad)*sizeof(vga_pixel)+4);
+    ring = &ring_alloc[pad];
+    ring_lines = nblines;
+    setLineRing(ring, nblines);
+    return(vga_error_t::VGA_OK);
+}
+
+void VGA_T4::GameEngine::tile_data(int index, vga_pixel * data, int len)
+{
+    if ((index < 0) || (index >= nb_tiles) || (tile_cache.count > 0)) return;
+    memcpy((void*)&((unsigned char *)tilesbuffer)[index*tile_size],(void*)data,len);
+    tile_check(index);
+    mark_tile(index);
 }
 
-void VGA_T4::GameEngine::tile_data(unsigned char index, vga_pixel * data, int len)
+// Rows of a tile as masks of the pixels not 0 (color index 0 if packed),
+// a tile without any pixel 0 hides the layers below
+void VGA_T4::GameEngine::tile_check(int index)
 {
-    memcpy((void*)&tilesbuffer[index*TILES_W*TILES_H],(void*)data,len);
+    const unsigned char * bytes = &((const unsigned char *)tilesbuffer)[tile_cache.slot[index]*tile_size];
+    uint16_t * rows = &tile_rows[index*TILES_H];
+    unsigned char opaque = 1;
+    for (int ty=0; ty<TILES_H; ty++)
+    {
+        uint16_t m = 0;
+        for (int tx=0; tx<TILES_W; tx++)
+        {
+            int pos = ty*TILES_W + tx;
+            bool on = packed ? ((bytes[pos >> 1] >> ((pos & 1)*4)) & 0xf) : (((const vga_pixel *)bytes)[pos] != 0);
+            if (on) m |= 1 << tx;
+        }
+        rows[ty] = m;
+        if (m != (1 << TILES_W) - 1) opaque = 0;
+    }
+    nb_opq += opaque - tile_opq[index];
+    tile_opq[index] = opaque;
 }
 
 void VGA_T4::GameEngine::sprite_data(unsigned char index, vga_pixel * data, int len)
 {
-    memcpy((void*)&spritesbuffer[index*SPRITES_W*SPRITES_H],(void*)data,len);
+    if ((index >= nb_sprites) || (sprite_cache.count > 0)) return;
+    memcpy((void*)&((unsigned char *)spritesbuffer)[index*sprite_size],(void*)data,len);
+    frame_changed(index);
 }
 
+// Show sprite id at x,y with frame index, shown sprites go to the active list
 void VGA_T4::GameEngine::sprite(int id , int x, int y, unsigned char index)
 {
-    if (id < SPRITES_MAX) {
-        spritesdata[id].x = x;
-        spritesdata[id].y = y;
-        spritesdata[id].index = index;
+    if ((id < 0) || (id >= SPRITES_MAX) || (index >= nb_sprites)) return;
+    Sprite_t * spr = &spritesdata[id];
+    if (spr->slot < 0) {
+        active_insert(id);
     }
+    else {
+        if ( (spr->x == x) && (spr->y == y) && (spr->index == index) ) return;
+        mark_sprite(id);
+    }
+    spr->x = x;
+    spr->y = y;
+    spr->index = index;
+    sprite_bounds(spr);
+    mark_sprite(id);
 }
 
 
 void VGA_T4::GameEngine::sprite_hide(int id)
 {
-    if (id < SPRITES_MAX) {
-        spritesdata[id].x = -16;
-        spritesdata[id].y = -16;
-        spritesdata[id].index = 0;
-    }
+    if ((id < 0) || (id >= SPRITES_MAX)) return;
+    Sprite_t * spr = &spritesdata[id];
+    if (spr->slot < 0) return;
+    mark_sprite(id);
+    coll_remove(id);
+    active_remove(id);
 }
 
-void VGA_T4::GameEngine::tile_draw(int layer, int x, int y, unsigned char index)
-{
-    tilesram[(y+layer*TILES_ROWS)*TILES_COLS+x] = index;
+// place of a sprite in the active list, sorted on z then id
+static inline int32_t active_key(const VGA_T4::Sprite_t *spr, int id) {
+    return spr->z*65536 + id;
 }
 
-void VGA_T4::GameEngine::tile_draw_row(int layer, int x, int y, unsigned char * data, int len)
+void VGA_T4::GameEngine::active_insert(int id)
 {
-    while (len--)
+    int32_t key = active_key(&spritesdata[id], id);
+    int i = spr_nactive++;
+    while ( (i > 0) && (active_key(&spritesdata[spr_active[i-1]], spr_active[i-1]) > key) )
     {
-        tilesram[(y+layer*TILES_ROWS)*TILES_COLS+x++] = *data++;
+        spr_active[i] = spr_active[i-1];
+        spritesdata[spr_active[i]].slot = i;
+        i--;
     }
+    spr_active[i] = id;
+    spritesdata[id].slot = i;
 }
 
-void VGA_T4::GameEngine::tile_draw_col(int layer, int x, int y, unsigned char * data, int len)
+void VGA_T4::GameEngine::active_remove(int id)
 {
-    while (len--)
+    spr_nactive--;
+    for (int i=spritesdata[id].slot; i<spr_nactive; i++)
     {
-        tilesram[(y++ +layer*TILES_ROWS)*TILES_COLS+x] = *data++;
+        spr_active[i] = spr_active[i+1];
+        spritesdata[spr_active[i]].slot = i;
     }
+    spritesdata[id].slot = -1;
 }
 
-void VGA_T4::GameEngine::hscroll(int layer, int value)
-{
-    hscr[layer] = value;
-}
+/*******************************************************************
+ Compiled sprites:
+ - sprite_compile encodes every row of a frame as runs of non
+   transparent pixels (x, length), the compositor then copies or
+   blends whole runs and jumps over the transparent pixels
+ - layout: h+1 offsets of the runs of each row, then the runs
+ - for packed sprites the transparent pixels are the 0 nibbles
+ - changing the frame or its pixels drops the runs, compile again
+*******************************************************************/
 
-void VGA_T4::GameEngine::vscroll(int layer, int value)
+// Encode the opaque runs of frame index (after its pixels are set)
+void VGA_T4::GameEngine::sprite_compile(int index)
 {
-    vscr[layer] = value;
+    if ((index < 0) || (index >= nb_sprites)) return;
+    Frame_t * f = &frames[index];
+    frame_changed(index);
+    sprite_resident(index);
+
+    // count the runs, then fill them
+    uint16_t * spans = NULL;
+    for (int pass=0; pass<2; pass++)
+    {
+        int pos = f->h + 1;
+        for (int row=0; row<f->h; row++)
+        {
+            if (spans != NULL) spans[row] = pos;
+            int base = (f->y + row)*atlas_w + f->x;
+            int x = 0;
+            while (x < f->w)
+            {
+                while ( (x < f->w) && (packed ? !((((const unsigned char *)atlas)[(base + x)/2] >> (((base + x) & 1)*4)) & 0xf) : !atlas[base + x]) ) x++;
+                if (x >= f->w) break;
+                int beg = x;
+                while ( (x < f->w) && (packed ? ((((const unsigned char *)atlas)[(base + x)/2] >> (((base + x) & 1)*4)) & 0xf) : atlas[base + x]) ) x++;
+                if (spans != NULL) {
+                    spans[pos] = beg;
+                    spans[pos+1] = x - beg;
+                }
+                pos += 2;
+            }
+        }
+        if (spans != NULL) {
+            spans[f->h] = pos;
+            break;
+        }
+        spans = (uint16_t *)vga_alloc(pos*sizeof(uint16_t), GE_REGION);
+        if (spans == NULL) return;
+    }
+    f->spans = spans;
 }
 
-void VGA_T4::GameEngine::set_hscroll(int layer, int rowbeg, int rowend, int mask)
+// frame index moves or its pixels change: drop its runs and mask, redraw its sprites
+void VGA_T4::GameEngine::frame_changed(int index)
 {
-    hscr_beg[layer] = rowbeg;
-    hscr_end[layer] = rowend;
-    hscr_mask = mask+1;
+    if (frames[index].spans != NULL) {
+        vga_free(frames[index].spans, GE_REGION);
+        frames[index].spans = NULL;
+    }
+    if (frames[index].mask != NULL) {
+        vga_free(frames[index].mask, GE_REGION);
+        frames[index].mask = NULL;
+    }
+    for (int i=0; i<spr_nactive; i++)
+    {
+        if (spritesdata[spr_active[i]].index == index) mark_sprite(spr_active[i]);
+    }
 }
 
-void VGA_T4::GameEngine::set_vscroll(int layer, int colbeg, int colend, int mask)
-{
-    hscr_beg[layer] = colbeg;
-    hscr_end[layer] = colend;
+// screen box of a sprite from its frame and transform
+void VGA_T4::GameEngine::sprite_bounds(Sprite_t *spr) {
+    const Frame_t * f = &frames[spr->index];
+    if ( (spr->xform == SPRITE_XFORM_FLIP) && (spr->flip & SPRITE_ROT90) ) {
+        spr->w = f->h;
+        spr->h = f->w;
+        spr->bx = spr->x + (f->w - f->h)/2;
+        spr->by = spr->y + (f->h - f->w)/2;
+    }
+    else if (spr->xform == SPRITE_XFORM_AFFINE) {
+        // forward matrix, half size of the box
+        float det = ((float)spr->pa*spr->pd - (float)spr->pb*spr->pc) / 65536.0f;
+        float fa = spr->pd / det, fb = -spr->pb / det;
+        float fc = -spr->pc / det, fd = spr->pa / det;
+        float hx = (fabsf(fa)*f->w + fabsf(fb)*f->h) / 2;
+        float hy = (fabsf(fc)*f->w + fabsf(fd)*f->h) / 2;
+        float cx = spr->x + f->w/2.0f;
+        float cy = spr->y + f->h/2.0f;
+        spr->bx = (int)floorf(cx - hx);
+        spr->by = (int)floorf(cy - hy);
+        spr->w = (int)ceilf(cx + hx) - spr->bx;
+        spr->h = (int)ceilf(cy + hy) - spr->by;
+    }
+    else {
+        spr->w = f->w;
+        spr->h = f->h;
+        spr->bx = spr->x;
+        spr->by = spr->y;
+    }
+    if (spr->group != 0) {
+        coll_remove(spr - spritesdata);
+        coll_insert(spr - spritesdata);
+    }
+}
+
+// Flip and rotate a sprite by 90 degrees steps (SPRITE_HFLIP, SPRITE_VFLIP, SPRITE_ROT90), 0 to show it as is
+void VGA_T4::GameEngine::sprite_flip(int id, int flags)
+{
+    if ((id < 0) || (id >= SPRITES_MAX)) return;
+    Sprite_t * spr = &spritesdata[id];
+    mark_sprite(id);
+    spr->xform = (flags != 0) ? SPRITE_XFORM_FLIP : 0;
+    spr->flip = flags;
+    sprite_bounds(spr);
+    mark_sprite(id);
+}
+
+// Transform a sprite around the center of its frame, pa..pd is the inverse matrix in Q16
+// (frame pixels per screen pixel: u = pa*x + pb*y, v = pc*x + pd*y)
+void VGA_T4::GameEngine::sprite_affine(int id, int32_t pa, int32_t pb, int32_t pc, int32_t pd)
+{
+    if ((id < 0) || (id >= SPRITES_MAX)) return;
+    if (((int64_t)pa*pd - (int64_t)pb*pc) == 0) return;
+    Sprite_t * spr = &spritesdata[id];
+    mark_sprite(id);
+    spr->xform = SPRITE_XFORM_AFFINE;
+    spr->pa = pa;
+    spr->pb = pb;
+    spr->pc = pc;
+    spr->pd = pd;
+    sprite_bounds(spr);
+    mark_sprite(id);
+}
+
+// Rotate a sprite by angle degrees clockwise and scale it (Q16, 65536 is 1),
+// quarter turns at scale 1 use sprite_flip
+void VGA_T4::GameEngine::sprite_rotozoom(int id, int angle, int32_t scale)
+{
+    if (scale <= 0) return;
+    angle %= 360;
+    if (angle < 0) angle += 360;
+    if ( (scale == 65536) && ((angle % 90) == 0) ) {
+        static const unsigned char quarter[4] = { 0, SPRITE_ROT90, SPRITE_HFLIP|SPRITE_VFLIP, SPRITE_ROT90|SPRITE_HFLIP|SPRITE_VFLIP };
+        sprite_flip(id, quarter[angle / 90]);
+        return;
+    }
+    float a = angle * (float)M_PI / 180.0f;
+    float k = 65536.0f * 65536.0f / scale;
+    int32_t c = (int32_t)lroundf(cosf(a) * k);
+    int32_t s = (int32_t)lroundf(sinf(a) * k);
+    sprite_affine(id, c, s, -s, c);
+}
+
+/*******************************************************************
+ Collisions:
+ - sprites with a collision group are kept in a grid of squares of
+   1 << COLL_CELL_BITS pixels, hashed in COLL_BUCKETS lists, a
+   sprite is moved in the grid when its box changes
+ - sprite_hits only looks at the sprites of the squares the sprite
+   covers, then compares the boxes, then the 1 bit masks of the
+   frames 32 pixels at a time (transformed sprites: boxes only)
+ - tiles have solidity flags (tile_solid), tile_hits returns the
+   flags of the map cells under a sprite
+*******************************************************************/
+
+static inline int coll_hash(int cx, int cy) {
+    return ((cx * 73856093) ^ (cy * 19349663)) & (COLL_BUCKETS - 1);
+}
+
+void VGA_T4::GameEngine::coll_remove(int id) {
+    Sprite_t * spr = &spritesdata[id];
+    for (int k=0; k<spr->ncells; k++)
+    {
+        int node = id*4 + k;
+        if (coll_prev[node] >= 0) coll_next[coll_prev[node]] = coll_next[node];
+        else coll_head[coll_bucket[node]] = coll_next[node];
+        if (coll_next[node] >= 0) coll_prev[coll_next[node]] = coll_prev[node];
+    }
+    spr->ncells = 0;
+}
+
+void VGA_T4::GameEngine::coll_insert(int id) {
+    Sprite_t * spr = &spritesdata[id];
+    if ( (spr->slot < 0) || (spr->group == 0) ) return;
+    int cx1 = spr->bx >> COLL_CELL_BITS;
+    int cy1 = spr->by >> COLL_CELL_BITS;
+    int cx2 = (spr->bx + spr->w - 1) >> COLL_CELL_BITS;
+    int cy2 = (spr->by + spr->h - 1) >> COLL_CELL_BITS;
+    int buckets[4];
+    int n = 0;
+    if (((cx2 - cx1 + 1)*(cy2 - cy1 + 1)) > 4) {
+        buckets[n++] = COLL_BUCKETS;
+    }
+    else {
+        for (int cy=cy1; cy<=cy2; cy++)
+        {
+            for (int cx=cx1; cx<=cx2; cx++)
+            {
+                int b = coll_hash(cx, cy);
+                bool dup = false;
+                for (int k=0; k<n; k++) dup |= (buckets[k] == b);
+                if (!dup) buckets[n++] = b;
+            }
+        }
+    }
+    for (int k=0; k<n; k++)
+    {
+        int node = id*4 + k;
+        coll_bucket[node] = buckets[k];
+        coll_prev[node] = -1;
+        coll_next[node] = coll_head[buckets[k]];
+        if (coll_head[buckets[k]] >= 0) coll_prev[coll_head[buckets[k]]] = node;
+        coll_head[buckets[k]] = node;
+    }
+    spr->ncells = n;
+}
+
+// 1 bit per pixel of a frame, MSB first, rows of (w+31)/32 + 1 words (the last one is 0)
+const uint32_t * VGA_T4::GameEngine::frame_mask(int index) {
+    Frame_t * f = &frames[index];
+    if (f->mask != NULL) return f->mask;
+    sprite_resident(index);
+    int words = ((f->w + 31) >> 5) + 1;
+    f->mask = (uint32_t *)vga_alloc(words*f->h*sizeof(uint32_t), GE_REGION);
+    if (f->mask == NULL) return NULL;
+    memset((void*)f->mask, 0, words*f->h*sizeof(uint32_t));
+    Sprite_t spr;
+    spr.index = index;
+    spr.palette = 0;
+    for (int v=0; v<f->h; v++)
+    {
+        for (int u=0; u<f->w; u++)
+        {
+            int pos = (f->y + v)*atlas_w + f->x + u;
+            bool on = packed ? ((((const unsigned char *)atlas)[pos >> 1] >> ((pos & 1)*4)) & 0xf) : (sprite_pixel(&spr, u, v) != 0);
+            if (on) f->mask[v*words + (u >> 5)] |= 0x80000000u >> (u & 31);
+        }
+    }
+    return f->mask;
+}
+
+// 32 bits of a mask row from bit pos
+static inline uint32_t mask_bits(const uint32_t *row, int pos) {
+    int s = pos & 31;
+    row += pos >> 5;
+    return s ? ((row[0] << s) | (row[1] >> (32 - s))) : row[0];
+}
+
+// pixels of 2 untransformed sprites over each other
+bool VGA_T4::GameEngine::mask_hit(int id1, int id2) {
+    Sprite_t * a = &spritesdata[id1];
+    Sprite_t * b = &spritesdata[id2];
+    const uint32_t * ma = frame_mask(a->index);
+    const uint32_t * mb = frame_mask(b->index);
+    if ( (ma == NULL) || (mb == NULL) ) return true;
+    int wa = ((a->w + 31) >> 5) + 1;
+    int wb = ((b->w + 31) >> 5) + 1;
+    int x1 = (a->bx > b->bx) ? a->bx : b->bx;
+    int y1 = (a->by > b->by) ? a->by : b->by;
+    int x2 = ((a->bx + a->w) < (b->bx + b->w)) ? a->bx + a->w : b->bx + b->w;
+    int y2 = ((a->by + a->h) < (b->by + b->h)) ? a->by + a->h : b->by + b->h;
+    for (int y=y1; y<y2; y++)
+    {
+        const uint32_t * ra = &ma[(y - a->by)*wa];
+        const uint32_t * rb = &mb[(y - b->by)*wb];
+        for (int x=x1; x<x2; x+=32)
+        {
+            uint32_t bits = mask_bits(ra, x - a->bx) & mask_bits(rb, x - b->bx);
+            if ((x2 - x) < 32) bits &= ~(0xffffffffu >> (x2 - x));
+            if (bits) return true;
+        }
+    }
+    return false;
+}
+
+// Collision groups of a sprite (bits), and the groups it hits, group 0 leaves the grid
+void VGA_T4::GameEngine::sprite_collision(int id, unsigned char group, unsigned char with)
+{
+    if ((id < 0) || (id >= SPRITES_MAX)) return;
+    coll_remove(id);
+    spritesdata[id].group = group;
+    spritesdata[id].with = with;
+    coll_insert(id);
+}
+
+// Sprites of the groups sprite id hits over it (at most max ids), pixel: compare the pixels, not only the boxes
+int VGA_T4::GameEngine::sprite_hits(int id, int16_t *ids, int max, bool pixel)
+{
+    if ((id < 0) || (id >= SPRITES_MAX)) return 0;
+    Sprite_t * spr = &spritesdata[id];
+    if ( (spr->slot < 0) || (spr->with == 0) ) return 0;
+
+    // mark the sprites already seen
+    if (++coll_query == 0) {
+        memset((void*)coll_stamp, 0, sizeof(coll_stamp));
+        coll_query = 1;
+    }
+    coll_stamp[id] = coll_query;
+
+    int cx1 = spr->bx >> COLL_CELL_BITS;
+    int cy1 = spr->by >> COLL_CELL_BITS;
+    int cx2 = (spr->bx + spr->w - 1) >> COLL_CELL_BITS;
+    int cy2 = (spr->by + spr->h - 1) >> COLL_CELL_BITS;
+    // lists of the squares (all of them for a large box), then the list of large sprites
+    int buckets[17];
+    int nb = 0;
+    bool all = ((cx2 - cx1 + 1)*(cy2 - cy1 + 1)) > 16;
+    if (!all) {
+        for (int cy=cy1; cy<=cy2; cy++)
+        {
+            for (int cx=cx1; cx<=cx2; cx++) buckets[nb++] = coll_hash(cx, cy);
+        }
+    }
+    buckets[nb++] = COLL_BUCKETS;
+
+    int n = 0;
+    for (int k=0; k<(all ? COLL_BUCKETS + 1 : nb); k++)
+    {
+        for (int node = coll_head[all ? k : buckets[k]]; node >= 0; node = coll_next[node])
+        {
+            int other = node >> 2;
+            if (coll_stamp[other] == coll_query) continue;
+            coll_stamp[other] = coll_query;
+            Sprite_t * o = &spritesdata[other];
+            if (!(spr->with & o->group)) continue;
+            if ( (o->bx >= spr->bx + spr->w) || (spr->bx >= o->bx + o->w) ) continue;
+            if ( (o->by >= spr->by + spr->h) || (spr->by >= o->by + o->h) ) continue;
+            if ( pixel && (spr->xform == 0) && (o->xform == 0) && !mask_hit(id, other) ) continue;
+            if (n < max) ids[n] = other;
+            n++;
+        }
+    }
+    return (n < max) ? n : max;
+}
+
+// Two shown sprites over each other (boxes, then pixels)
+bool VGA_T4::GameEngine::sprite_hit(int id1, int id2, bool pixel)
+{
+    if ((id1 < 0) || (id1 >= SPRITES_MAX) || (id2 < 0) || (id2 >= SPRITES_MAX) || (id1 == id2)) return false;
+    Sprite_t * a = &spritesdata[id1];
+    Sprite_t * b = &spritesdata[id2];
+    if ( (a->slot < 0) || (b->slot < 0) ) return false;
+    if ( (a->bx >= b->bx + b->w) || (b->bx >= a->bx + a->w) ) return false;
+    if ( (a->by >= b->by + b->h) || (b->by >= a->by + a->h) ) return false;
+    if ( pixel && (a->xform == 0) && (b->xform == 0) ) return mask_hit(id1, id2);
+    return true;
+}
+
+// Solidity flags of a tile (game defined bits)
+void VGA_T4::GameEngine::tile_solid(int index, unsigned char flags)
+{
+    if ((index >= 0) && (index < nb_tiles)) tile_flags[index] = flags;
+}
+
+// Flags of the tile shown at screen x,y on a layer (with the scroll bands and tables, or mode 7)
+unsigned char VGA_T4::GameEngine::tile_at(int layer, int x, int y)
+{
+    if ((layer < 0) || (layer >= nb_layers)) return 0;
+    uint16_t cell;
+    if (layers[layer].m7_on) {
+        // a mode 7 line table only has the screen lines
+        if ( (layers[layer].m7_tab != NULL) && ((y < 0) || (y >= fb_height)) ) return 0;
+        Mode7_t l;
+        mode7_line(layer, y, &l);
+        int px = m7_wrap((int64_t)l.u + (int64_t)l.du*x, M7_MAPW) >> 16;
+        int py = m7_wrap((int64_t)l.v + (int64_t)l.dv*x, M7_MAPH) >> 16;
+        cell = tilesram[(layer*TILES_ROWS + (py >> TILES_HBITS))*TILES_COLS + (px >> TILES_HBITS)];
+    }
+    else cell = layer_cell(layer, x, y);
+    int tile = cell & TILE_INDEX_MASK;
+    return (tile < nb_tiles) ? tile_flags[tile] : 0;
+}
+
+// next sample after v: step further, stopped on both sides of a scroll band edge e1/e2 and at end
+static inline int hits_next(int v, int step, int e1, int e2, int end) {
+    int edges[4] = { e1 - 1, e1, e2 - 1, e2 };
+    int n = v + step;
+    for (int i=0; i<4; i++)
+    {
+        if ( (edges[i] > v) && (edges[i] < n) ) n = edges[i];
+    }
+    return (n > end) ? end : n;
+}
+
+// Flags of all the tiles of a layer under the box of a sprite
+unsigned char VGA_T4::GameEngine::tile_hits(int layer, int id)
+{
+    if ((id < 0) || (id >= SPRITES_MAX) || (layer < 0) || (layer >= nb_layers)) return 0;
+    Sprite_t * spr = &spritesdata[id];
+    if (spr->slot < 0) return 0;
+    Layer_t * l = &layers[layer];
+    // a sample per tile, restarting at each band edge; every line with a line table, every pixel in mode 7
+    int xstep = l->m7_on ? 1 : TILES_W;
+    int ystep = (l->m7_on || (l->hscr_tab != NULL)) ? 1 : TILES_H;
+    int hb1 = l->hscr_beg << TILES_HBITS;
+    int hb2 = (l->hscr_end + 1) << TILES_HBITS;
+    int vb1 = l->vscr_beg << TILES_HBITS;
+    int vb2 = (l->vscr_end + 1) << TILES_HBITS;
+    unsigned char flags = 0;
+    int x2 = spr->bx + spr->w - 1;
+    int y2 = spr->by + spr->h - 1;
+    for (int y=spr->by; ; y=hits_next(y, ystep, hb1, hb2, y2))
+    {
+        for (int x=spr->bx; ; x=hits_next(x, xstep, vb1, vb2, x2))
+        {
+            flags |= tile_at(layer, x, y);
+            if (x == x2) break;
+        }
+        if (y == y2) break;
+    }
+    return flags;
+}
+
+// At most perline sprites on a line (the highest z are kept), 0 for no limit
+void VGA_T4::GameEngine::sprite_limit(int perline)
+{
+    spr_cap = perline;
+    dirty_all = true;
+}
+
+// Sprite counts of the last run_gfxengine
+const VGA_T4::SpriteStats_t & VGA_T4::GameEngine::sprite_stats()
+{
+    return spr_stats;
+}
+
+// Drawing order key of a sprite, higher z is drawn above, same z by id
+void VGA_T4::GameEngine::sprite_z(int id, int z)
+{
+    if ((id < 0) || (id >= SPRITES_MAX)) return;
+    Sprite_t * spr = &spritesdata[id];
+    if (spr->z == z) return;
+    spr->z = z;
+    if (spr->slot >= 0) {
+        active_remove(id);
+        active_insert(id);
+    }
+    mark_sprite(id);
+}
+
+// Image holding the sprite frames, width in pixels (2 pixels per byte if packed),
+// the frames are reset to the default size one below the other
+void VGA_T4::GameEngine::sprite_atlas(const vga_pixel *image, int width)
+{
+    if (sprite_cache.count > 0) return;
+    atlas = (image != NULL) ? image : spritesbuffer;
+    atlas_w = (image != NULL) ? width : SPRITES_W;
+    for (int i=0; i<nb_sprites; i++) sprite_frame(i, 0, i*SPRITES_H, SPRITES_W, SPRITES_H);
+}
+
+// Frame index is the w x h rectangle at x,y of the atlas (x and w even if packed)
+void VGA_T4::GameEngine::sprite_frame(int index, int x, int y, int w, int h)
+{
+    if ((index < 0) || (index >= nb_sprites) || (sprite_cache.count > 0)) return;
+    if (w > SPRITES_MAX_W) w = SPRITES_MAX_W;
+    frame_changed(index);
+    frames[index].x = x;
+    frames[index].y = y;
+    frames[index].w = w;
+    frames[index].h = h;
+    for (int i=0; i<spr_nactive; i++)
+    {
+        Sprite_t * spr = &spritesdata[spr_active[i]];
+        if (spr->index != index) continue;
+        mark_sprite(spr_active[i]);
+        sprite_bounds(spr);
+        mark_sprite(spr_active[i]);
+    }
+}
+
+// 16 colors of a palette (packed tiles and sprites), color 0 is transparent on LAYER_TRANSPARENT layers
+void VGA_T4::GameEngine::set_palette(int index, const vga_pixel *colors)
+{
+    if ((index < 0) || (index > 15)) return;
+    memcpy((void*)palettes[index], (void*)colors, sizeof(palettes[index]));
+    pal_update(index);
+    dirty_all = true;
+}
+
+// pixel pairs of packed bytes from the colors of a palette, and the same with color 0 keyed
+void VGA_T4::GameEngine::pal_update(int index)
+{
+    const vga_pixel * colors = palettes[index];
+    if (pal_pairs != NULL) {
+        for (int i=0; i<256; i++)
+        {
+#ifdef BITS12
+            pal_pairs[index][i] = colors[i & 0xf] | (colors[i >> 4] << 16);
+#else
+            pal_pairs[index][i] = colors[i & 0xf] | (colors[i >> 4] << 8);
+#endif
+        }
+    }
+    for (int i=1; i<16; i++)
+    {
+        if (colors[i] == key_color) {
+            key_update();
+            return;
+        }
+    }
+    key_fill(index);
+}
+
+// keyed colors and pairs of a palette
+void VGA_T4::GameEngine::key_fill(int index)
+{
+    vga_pixel * colors = key_colors[index];
+    memcpy((void*)colors, (void*)palettes[index], sizeof(key_colors[index]));
+    colors[0] = key_color;
+    if (key_pairs != NULL) {
+        for (int i=0; i<256; i++)
+        {
+#ifdef BITS12
+            key_pairs[index][i] = colors[i & 0xf] | (colors[i >> 4] << 16);
+#else
+            key_pairs[index][i] = colors[i & 0xf] | (colors[i >> 4] << 8);
+#endif
+        }
+    }
+}
+
+// a key_color no palette uses for colors 1 to 15 (packed), the keyed tables follow it
+void VGA_T4::GameEngine::key_update()
+{
+    vga_pixel key = key_color;
+    if (packed) {
+        for (int p=0; p<16; p++)
+        {
+            for (int i=1; i<16; i++)
+            {
+                if (palettes[p][i] != key) continue;
+                key++;
+                p = -1;
+                break;
+            }
+        }
+    }
+    else key = 0;
+    key_color = key;
+    for (int p=0; p<16; p++) key_fill(p);
+}
+
+// Palette of a packed tile definition
+void VGA_T4::GameEngine::tile_palette(int index, int palette)
+{
+    if ((index >= 0) && (index < nb_tiles)) {
+        tile_pal[index] = palette & 0xf;
+        anim_valid = false;
+        mark_tile(index);
+    }
+}
+
+/*******************************************************************
+ Animated tiles and palette cycles:
+ - map cells keep the tile index, tile_map[index] is the tile
+   definition drawn for it (itself unless animated), so an animation
+   step is one store whatever the number of cells using the tile
+ - palette cycles rotate colors of the palettes of packed tiles and
+   sprites in place
+ - anim_step runs once per run_gfxengine, and only the map cells
+   showing a changed tile or palette are marked dirty: the cells of
+   each animation and of each cycled palette (packed) are listed in
+   anim_cells (counting sort), the list is built again after a map
+   change involving them, so a step costs the cells it changes
+*******************************************************************/
+
+// group of a map cell in anim_cells: its animation, else the cycled palette of a packed tile, else -1
+int VGA_T4::GameEngine::anim_group(uint16_t cell)
+{
+    int tile = cell & TILE_INDEX_MASK;
+    for (int i=0; i<nb_anims; i++)
+    {
+        if (anims[i].tile == tile) return i;
+    }
+    if (!packed) return -1;
+    int pal = (tile_pal[tile] + (cell >> TILE_PAL_SHIFT)) & 0xf;
+    for (int i=0; i<nb_cycles; i++)
+    {
+        if (cycles[i].palette == pal) return TILES_ANIMS + pal;
+    }
+    return -1;
+}
+
+// map cells per group, false if there is no memory for them
+bool VGA_T4::GameEngine::anim_index()
+{
+    int ncells = nb_layers*TILES_ROWS*TILES_COLS;
+    memset((void*)anim_start, 0, sizeof(anim_start));
+    for (int i=0; i<ncells; i++)
+    {
+        int g = anim_group(tilesram[i]);
+        if (g >= 0) anim_start[g+1]++;
+    }
+    for (int g=0; g<ANIM_GROUPS; g++) anim_start[g+1] += anim_start[g];
+    if (anim_cells != NULL) vga_free(anim_cells, GE_REGION);
+    anim_cells = (uint16_t *)vga_alloc((anim_start[ANIM_GROUPS] + 1)*sizeof(uint16_t), GE_REGION);
+    if (anim_cells == NULL) return false;
+
+    // anim_start[g] ends at the start of group g+1, then is restored
+    for (int i=0; i<ncells; i++)
+    {
+        int g = anim_group(tilesram[i]);
+        if (g >= 0) anim_cells[anim_start[g]++] = i;
+    }
+    for (int g=ANIM_GROUPS; g>0; g--) anim_start[g] = anim_start[g-1];
+    anim_start[0] = 0;
+    anim_valid = true;
+    return true;
+}
+
+// the cells of group g, only those showing palette pal if pal >= 0
+void VGA_T4::GameEngine::anim_mark(int g, int pal)
+{
+    for (int i=anim_start[g]; i<anim_start[g+1]; i++)
+    {
+        int pos = anim_cells[i];
+        int layer = pos / (TILES_ROWS*TILES_COLS);
+        if (layers[layer].state == LAYER_DISABLED) continue;
+        if (pal >= 0) {
+            uint16_t cell = tilesram[pos];
+            if (((tile_pal[tile_map[cell & TILE_INDEX_MASK]] + (cell >> TILE_PAL_SHIFT)) & 0xf) != pal) continue;
+        }
+        pos -= layer*TILES_ROWS*TILES_COLS;
+        mark_cell(layer, pos % TILES_COLS, pos / TILES_COLS);
+    }
+}
+
+// Animate tile index: it shows frames[0..count-1] (tile definitions), period run_gfxengine each,
+// count 0 stops it
+void VGA_T4::GameEngine::tile_anim(int index, const uint16_t *frames, int count, int period)
+{
+    if ((index < 0) || (index >= nb_tiles)) return;
+    int i;
+    for (i=0; i<nb_anims; i++)
+    {
+        if (anims[i].tile == index) break;
+    }
+    if ( (frames == NULL) || (count <= 0) ) {
+        if (i == nb_anims) return;
+        anims[i] = anims[--nb_anims];
+        tile_map[index] = index;
+        anim_valid = false;
+        mark_tile(index);
+        return;
+    }
+    if (i == nb_anims) {
+        if (nb_anims == TILES_ANIMS) return;
+        nb_anims++;
+    }
+    TileAnim_t * a = &anims[i];
+    a->frames = frames;
+    a->tile = index;
+    a->count = (count > 255) ? 255 : count;
+    a->period = (period < 1) ? 1 : ((period > 255) ? 255 : period);
+    a->pos = 0;
+    a->tick = 0;
+    if ((frames[0] & TILE_INDEX_MASK) < nb_tiles) tile_map[index] = frames[0] & TILE_INDEX_MASK;
+    anim_valid = false;
+    mark_tile(index);
+}
+
+// Rotate colors first..last of a palette by one every period run_gfxengine, period 0 stops it
+void VGA_T4::GameEngine::palette_cycle(int palette, int first, int last, int period)
+{
+    if ((palette < 0) || (palette > 15) || (first < 0) || (last > 15) || (first >= last)) return;
+    int i;
+    for (i=0; i<nb_cycles; i++)
+    {
+        if ( (cycles[i].palette == palette) && (cycles[i].first == first) ) break;
+    }
+    if (period <= 0) {
+        if (i < nb_cycles) cycles[i] = cycles[--nb_cycles];
+        anim_valid = false;
+        return;
+    }
+    if (i == nb_cycles) {
+        if (nb_cycles == PAL_CYCLES) return;
+        nb_cycles++;
+    }
+    PalCycle_t * c = &cycles[i];
+    c->palette = palette;
+    c->first = first;
+    c->last = last;
+    c->period = (period > 255) ? 255 : period;
+    c->tick = 0;
+    anim_valid = false;
+}
+
+// one frame of the animations and cycles
+void VGA_T4::GameEngine::anim_step()
+{
+    bool changed = false;
+    for (int i=0; i<nb_anims; i++)
+    {
+        TileAnim_t * a = &anims[i];
+        if (++a->tick < a->period) continue;
+        a->tick = 0;
+        if (++a->pos >= a->count) a->pos = 0;
+        int tile = a->frames[a->pos] & TILE_INDEX_MASK;
+        if ( (tile >= nb_tiles) || (tile_map[a->tile] == tile) ) continue;
+        tile_map[a->tile] = tile;
+        tile_mark[a->tile] = 1;
+        changed = true;
+    }
+    for (int i=0; i<nb_cycles; i++)
+    {
+        PalCycle_t * c = &cycles[i];
+        if (++c->tick < c->period) continue;
+        c->tick = 0;
+        vga_pixel * colors = palettes[c->palette];
+        vga_pixel last = colors[c->last];
+        memmove((void*)&colors[c->first+1], (void*)&colors[c->first], (c->last-c->first)*sizeof(vga_pixel));
+        colors[c->first] = last;
+        pal_update(c->palette);
+        pal_mark |= (1 << c->palette);
+        changed = true;
+    }
+    if (!changed) return;
+
+    if ( (!dirty_all) && (!anim_valid) && (!anim_index()) ) dirty_all = true;
+    if (!dirty_all) {
+        for (int i=0; i<nb_anims; i++)
+        {
+            if (tile_mark[anims[i].tile]) anim_mark(i, -1);
+        }
+        for (int p=0; p<16; p++)
+        {
+            if (!(pal_mark & (1 << p)) || (!packed)) continue;
+            anim_mark(TILES_ANIMS + p, -1);
+            for (int i=0; i<nb_anims; i++) anim_mark(i, p);
+        }
+    }
+    if ( (pal_mark) && (packed) ) {
+        for (int i=0; i<spr_nactive; i++)
+        {
+            if (pal_mark & (1 << spritesdata[spr_active[i]].palette)) mark_sprite(spr_active[i]);
+        }
+    }
+    for (int i=0; i<nb_anims; i++) tile_mark[anims[i].tile] = 0;
+    pal_mark = 0;
+}
+
+/*******************************************************************
+ Asset cache (tile_assets, sprite_assets):
+ - the master copies of the tiles and sprites stay in flash
+   (PROGMEM), EXTMEM or on SD (reader), the tile and sprite buffers
+   of begin_gfxengine become caches of that many slots
+ - tile cells and sprite frames index the assets, a tile is drawn
+   from tilesbuffer slot tile_cache.slot[tile], a sprite frame is
+   moved to its slot in spritesbuffer
+ - run_gfxengine loads the missing tiles of the maps (the streamed
+   rows and columns are there before they scroll in) and frames of
+   the shown sprites in vertical blank, replacing the slots least
+   recently used: the resident ones are kept for the frame first,
+   then the missing ones are loaded; there must be slots for all of
+   them, a tile or frame without a slot (or whose slot was taken) is
+   drawn from slot 0
+ - tile_data, sprite_data, sprite_atlas and sprite_frame are ignored
+   once assets are attached
+*******************************************************************/
+
+// Tiles come from count master copies at data (TILE_INDEX_MASK+1 at most)
+void VGA_T4::GameEngine::tile_assets(const void *data, int count)
+{
+    if (data != NULL) tiles_attach(data, NULL, count);
+}
+
+// Tiles are read by reader when needed
+void VGA_T4::GameEngine::tile_assets(asset_reader_t reader, int count)
+{
+    if (reader != NULL) tiles_attach(NULL, reader, count);
+}
+
+// Sprite frames (of the default size) come from count master copies at data (256 at most)
+void VGA_T4::GameEngine::sprite_assets(const void *data, int count)
+{
+    if (data != NULL) sprites_attach(data, NULL, count);
+}
+
+// Sprite frames are read by reader when needed
+void VGA_T4::GameEngine::sprite_assets(asset_reader_t reader, int count)
+{
+    if (reader != NULL) sprites_attach(NULL, reader, count);
+}
+
+// Tiles and sprite frames loaded in the caches so far
+int VGA_T4::GameEngine::asset_loads()
+{
+    return tile_cache.loads + sprite_cache.loads;
+}
+
+// empty cache of slots for count assets
+bool VGA_T4::GameEngine::assets_attach(AssetCache_t *c, const void *data, asset_reader_t reader, int count, int slots)
+{
+    uint16_t * slot = (uint16_t *)vga_alloc(count*sizeof(uint16_t), GE_REGION);
+    if (c->owner == NULL) c->owner = (uint16_t *)vga_alloc(slots*sizeof(uint16_t), GE_REGION);
+    if (c->stamp == NULL) c->stamp = (uint32_t *)vga_alloc(slots*sizeof(uint32_t), GE_REGION);
+    if ( (slot == NULL) || (c->owner == NULL) || (c->stamp == NULL) ) {
+        if (slot != NULL) vga_free(slot, GE_REGION);
+        return false;
+    }
+    if (c->slot != NULL) vga_free(c->slot, GE_REGION);
+    c->slot = slot;
+    memset((void*)c->slot, 0, count*sizeof(uint16_t));
+    for (int i=0; i<slots; i++)
+    {
+        c->owner[i] = ASSET_NONE;
+        c->stamp[i] = 0;
+    }
+    c->data = (const unsigned char *)data;
+    c->reader = reader;
+    c->count = count;
+    c->loads = 0;
+    return true;
+}
+
+void VGA_T4::GameEngine::tiles_attach(const void *data, asset_reader_t reader, int count)
+{
+    if ((count <= 0) || (count > TILE_INDEX_MASK+1)) return;
+
+    // tile properties are per asset
+    unsigned char * pal = (unsigned char *)vga_alloc(count, GE_REGION);
+    unsigned char * opq = (unsigned char *)vga_alloc(count, GE_REGION);
+    uint16_t * rows = (uint16_t *)vga_alloc(count*TILES_H*sizeof(uint16_t), GE_REGION);
+    unsigned char * mark = (unsigned char *)vga_alloc(count, GE_REGION);
+    unsigned char * flags = (unsigned char *)vga_alloc(count, GE_REGION);
+    uint16_t * map = (uint16_t *)vga_alloc(count*sizeof(uint16_t), GE_REGION);
+    if ( (pal == NULL) || (opq == NULL) || (rows == NULL) || (mark == NULL) || (flags == NULL) || (map == NULL) ||
+         (!assets_attach(&tile_cache, data, reader, count, tile_slots)) ) {
+        if (pal != NULL) vga_free(pal, GE_REGION);
+        if (opq != NULL) vga_free(opq, GE_REGION);
+        if (rows != NULL) vga_free(rows, GE_REGION);
+        if (mark != NULL) vga_free(mark, GE_REGION);
+        if (flags != NULL) vga_free(flags, GE_REGION);
+        if (map != NULL) vga_free(map, GE_REGION);
+        return;
+    }
+    vga_free(tile_pal, GE_REGION);
+    vga_free(tile_opq, GE_REGION);
+    vga_free(tile_rows, GE_REGION);
+    vga_free(tile_mark, GE_REGION);
+    vga_free(tile_flags, GE_REGION);
+    vga_free(tile_map, GE_REGION);
+    tile_pal = pal;
+    tile_opq = opq;
+    tile_rows = rows;
+    tile_mark = mark;
+    tile_flags = flags;
+    tile_map = map;
+    nb_tiles = count;
+    memset((void*)tile_pal, 0, count);
+    memset((void*)tile_opq, 0, count);
+    memset((void*)tile_rows, 0, count*TILES_H*sizeof(uint16_t));
+    memset((void*)tile_mark, 0, count);
+    memset((void*)tile_flags, 0, count);
+    for (int i=0; i<count; i++) tile_map[i] = i;
+    nb_opq = 0;
+    nb_anims = 0;
+    anim_valid = false;
+    dirty_all = true;
+}
+
+void VGA_T4::GameEngine::sprites_attach(const void *data, asset_reader_t reader, int count)
+{
+    if ((count <= 0) || (count > 256)) return;
+    VGA_T4::Frame_t * f = (VGA_T4::Frame_t *)vga_alloc(count*sizeof(Frame_t), GE_REGION);
+    if ( (f == NULL) || (!assets_attach(&sprite_cache, data, reader, count, sprite_slots)) ) {
+        if (f != NULL) vga_free(f, GE_REGION);
+        return;
+    }
+    for (int i=0; i<nb_sprites; i++)
+    {
+        if (frames[i].spans != NULL) vga_free(frames[i].spans, GE_REGION);
+        if (frames[i].mask != NULL) vga_free(frames[i].mask, GE_REGION);
+    }
+    vga_free(frames, GE_REGION);
+    frames = f;
+    nb_sprites = count;
+    memset((void*)frames, 0, count*sizeof(Frame_t));
+    for (int i=0; i<count; i++)
+    {
+        frames[i].w = SPRITES_W;
+        frames[i].h = SPRITES_H;
+    }
+    atlas = spritesbuffer;
+    atlas_w = SPRITES_W;
+
+    // shown sprites keep their frame if it exists
+    for (int i=spr_nactive-1; i>=0; i--)
+    {
+        Sprite_t * spr = &spritesdata[spr_active[i]];
+        if (spr->index >= count) {
+            sprite_hide(spr_active[i]);
+            continue;
+        }
+        sprite_bounds(spr);
+    }
+    dirty_all = true;
+}
+
+// cache slot of an asset, loaded if needed in the slot least recently used
+// (not one used by this run_gfxengine), -1 if there is none
+int VGA_T4::GameEngine::asset_fetch(AssetCache_t *c, int index, int slots, vga_pixel *buffer, int size)
+{
+    int s = c->slot[index];
+    if (c->owner[s] == index) {
+        c->stamp[s] = asset_frame;
+        return s;
+    }
+    s = -1;
+    uint32_t oldest = asset_frame;
+    for (int i=0; (i<slots) && (oldest > 0); i++)
+    {
+        if (c->stamp[i] < oldest) {
+            oldest = c->stamp[i];
+            s = i;
+        }
+    }
+    if (s < 0) return -1;
+    if (c->owner[s] != ASSET_NONE) {
+        c->slot[c->owner[s]] = 0;
+        if (c == &sprite_cache) frames[c->owner[s]].y = 0;
+    }
+    unsigned char * dst = &((unsigned char *)buffer)[s*size];
+    if (c->reader != NULL) c->reader(index, (void*)dst, size);
+    else memcpy((void*)dst, (void*)&c->data[index*size], size);
+    c->owner[s] = index;
+    c->slot[index] = s;
+    c->stamp[s] = asset_frame;
+    c->loads++;
+    return s;
+}
+
+// sprite frame index in the cache (its pixels are read)
+void VGA_T4::GameEngine::sprite_resident(int index)
+{
+    if (sprite_cache.count == 0) return;
+    int s = asset_fetch(&sprite_cache, index, sprite_slots, spritesbuffer, sprite_size);
+    if (s >= 0) frames[index].y = s*SPRITES_H;
+}
+
+// the tiles of the maps and the frames of the shown sprites in the caches
+void VGA_T4::GameEngine::assets_update()
+{
+    asset_frame++;
+    if (tile_cache.count > 0) {
+        // the resident tiles are stamped before a missing one takes the oldest slot
+        for (int layer=0; layer<nb_layers; layer++)
+        {
+            if (layers[layer].state == LAYER_DISABLED) continue;
+            const uint16_t * tilept = &tilesram[layer*TILES_ROWS*TILES_COLS];
+            for (int i=0; i<TILES_ROWS*TILES_COLS; i++)
+            {
+                int tile = tile_map[tilept[i] & TILE_INDEX_MASK];
+                if (tile_cache.owner[tile_cache.slot[tile]] == tile) tile_cache.stamp[tile_cache.slot[tile]] = asset_frame;
+            }
+        }
+        bool loaded = false;
+        for (int layer=0; layer<nb_layers; layer++)
+        {
+            if (layers[layer].state == LAYER_DISABLED) continue;
+            const uint16_t * tilept = &tilesram[layer*TILES_ROWS*TILES_COLS];
+            for (int i=0; i<TILES_ROWS*TILES_COLS; i++)
+            {
+                int tile = tile_map[tilept[i] & TILE_INDEX_MASK];
+                if (tile_cache.owner[tile_cache.slot[tile]] == tile) continue;
+                if (asset_fetch(&tile_cache, tile, tile_slots, tilesbuffer, tile_size) < 0) continue;
+                tile_check(tile);
+                tile_mark[tile] = 1;
+                loaded = true;
+            }
+        }
+        // cells drawn from slot 0 while their tile was missing
+        if (loaded) {
+            for (int layer=0; (layer<nb_layers) && (!dirty_all); layer++)
+            {
+                if (layers[layer].state == LAYER_DISABLED) continue;
+                const uint16_t * tilept = &tilesram[layer*TILES_ROWS*TILES_COLS];
+                for (int i=0; i<TILES_ROWS*TILES_COLS; i++)
+                {
+                    if (tile_mark[tile_map[tilept[i] & TILE_INDEX_MASK]]) mark_cell(layer, i % TILES_COLS, i / TILES_COLS);
+                }
+            }
+            memset((void*)tile_mark, 0, nb_tiles);
+        }
+    }
+    if (sprite_cache.count > 0) {
+        for (int i=0; i<spr_nactive; i++)
+        {
+            int index = spritesdata[spr_active[i]].index;
+            if (sprite_cache.owner[sprite_cache.slot[index]] == index) sprite_cache.stamp[sprite_cache.slot[index]] = asset_frame;
+        }
+        for (int i=0; i<spr_nactive; i++) sprite_resident(spritesdata[spr_active[i]].index);
+    }
+}
+
+// Palette of a packed sprite
+void VGA_T4::GameEngine::sprite_palette(int id, int palette)
+{
+    if ((id >= 0) && (id < SPRITES_MAX)) {
+        spritesdata[id].palette = palette & 0xf;
+        mark_sprite(id);
+    }
+}
+
+// Blend mode of a sprite, level is the coverage for VGA_BLEND_ALPHA (0..AA_LEVELS)
+void VGA_T4::GameEngine::sprite_blend(int id, vga_blend_t mode, int level)
+{
+    if ((id >= 0) && (id < SPRITES_MAX)) {
+        spritesdata[id].blend = mode;
+        spritesdata[id].level = level;
+        mark_sprite(id);
+    }
+}
+
+// LAYER_OPAQUE (hides the layers below), LAYER_TRANSPARENT (pixels 0 show them) or LAYER_DISABLED
+void VGA_T4::GameEngine::layer_state(int layer, int state)
+{
+    if ((layer >= 0) && (layer < nb_layers)) {
+        layers[layer].state = state;
+        dirty_all = true;
+    }
+}
+
+// Blend mode of a layer, level as for sprite_blend
+void VGA_T4::GameEngine::layer_blend(int layer, vga_blend_t mode, int level)
+{
+    if ((layer >= 0) && (layer < nb_layers)) {
+        layers[layer].mode = mode;
+        layers[layer].level = level;
+        dirty_all = true;
+    }
+}
+
+void VGA_T4::GameEngine::tile_draw(int layer, int x, int y, uint16_t cell)
+{
+    if ((layer < 0) || (layer >= nb_layers)) return;
+    uint16_t * tilept = &tilesram[(y+layer*TILES_ROWS)*TILES_COLS+x];
+    if (*tilept == cell) return;
+    if ( (anim_valid) && ((anim_group(*tilept) >= 0) || (anim_group(cell) >= 0)) ) anim_valid = false;
+    nb_prio += ((cell & TILE_PRIORITY) != 0) - ((*tilept & TILE_PRIORITY) != 0);
+    *tilept = cell;
+    mark_cell(layer, x, y);
+}
+
+void VGA_T4::GameEngine::tile_draw_row(int layer, int x, int y, unsigned char * data, int len)
+{
+    while (len--)
+    {
+        tile_draw(layer, x++, y, *data++);
+    }
+}
+
+void VGA_T4::GameEngine::tile_draw_col(int layer, int x, int y, unsigned char * data, int len)
+{
+    while (len--)
+    {
+        tile_draw(layer, x, y++, *data++);
+    }
+}
+
+void VGA_T4::GameEngine::tile_draw_row(int layer, int x, int y, const uint16_t * data, int len)
+{
+    while (len--)
+    {
+        tile_draw(layer, x++, y, *data++);
+    }
+}
+
+void VGA_T4::GameEngine::tile_draw_col(int layer, int x, int y, const uint16_t * data, int len)
+{
+    while (len--)
+    {
+        tile_draw(layer, x, y++, *data++);
+    }
+}
+
+void VGA_T4::GameEngine::hscroll(int layer, int value)
+{
+    if ((layer < 0) || (layer >= nb_layers)) return;
+    if (layers[layer].hscr == value) return;
+    layers[layer].hscr = value;
+    mark_rect(0, layers[layer].hscr_beg << TILES_HBITS, fb_width, (layers[layer].hscr_end - layers[layer].hscr_beg + 1) << TILES_HBITS);
+}
+
+void VGA_T4::GameEngine::vscroll(int layer, int value)
+{
+    if ((layer < 0) || (layer >= nb_layers)) return;
+    if (layers[layer].vscr == value) return;
+    layers[layer].vscr = value;
+    mark_rect(layers[layer].vscr_beg << TILES_HBITS, 0, (layers[layer].vscr_end - layers[layer].vscr_beg + 1) << TILES_HBITS, fb_height);
+}
+
+// Additional x scroll per screen line (fb_height values) on the rows of the horizontal band,
+// NULL to disable. The table is read while composing, the layer is redrawn every frame.
+void VGA_T4::GameEngine::hscroll_lines(int layer, const int16_t *table)
+{
+    if ((layer < 0) || (layer >= nb_layers)) return;
+    layers[layer].hscr_tab = table;
+    dirty_all = true;
+}
+
+// Additional y scroll per map column (TILES_COLS values) on the columns of the vertical band,
+// NULL to disable. The table is read while composing, the layer is redrawn every frame.
+void VGA_T4::GameEngine::vscroll_cols(int layer, const int16_t *table)
+{
+    if ((layer < 0) || (layer >= nb_layers)) return;
+    layers[layer].vscr_tab = table;
+    dirty_all = true;
+}
+
+// x scroll applies to screen tile rows rowbeg..rowend, the mask right most pixels are hidden
+void VGA_T4::GameEngine::set_hscroll(int layer, int rowbeg, int rowend, int mask)
+{
+    if ((layer < 0) || (layer >= nb_layers)) return;
+    layers[layer].hscr_beg = rowbeg;
+    layers[layer].hscr_end = rowend;
     hscr_mask = mask+1;
+    dirty_all = true;
 }
 
+// y scroll applies to screen tile columns colbeg..colend, the mask bottom lines are hidden
+void VGA_T4::GameEngine::set_vscroll(int layer, int colbeg, int colend, int mask)
+{
+    if ((layer < 0) || (layer >= nb_layers)) return;
+    layers[layer].vscr_beg = colbeg;
+    layers[layer].vscr_end = colend;
+    vscr_mask = mask+1;
+    dirty_all = true;
+}
@@ -16,6 +16,7 @@
 #include <Arduino.h>
 #include "VGA_t4.h"
 #include "VGA_font8x8.h"
+#include "VGA_Alloc.hpp"
 #include "VGA_settings.hpp"
 
 // Objective:
@@ -30,7 +31,7 @@
 // - supported resolutions: 320x240,320x480,640x240 and 640x480 pixels
 // - experimental resolution: 352x240,352x480
 // - experimental resolution: 512x240,512x480 (not stable)
-// - video memory is allocated using malloc in T4 heap
+// - video memory is allocated with vga_alloc in the FB_REGION (heap by default)
 // - as the 2 DMA transfers are not started exactly at same time, there is a bit of color smearing 
 //   but tried to be compensated by pixel shifting 
 // - Default is 8bits RRRGGGBB (332) 
@@ -42,11 +43,49 @@
 
 
 // Full buffer including back/front porch 
-static vga_pixel * gfxbuffer __attribute__((aligned(32))) = NULL;
+static vga_pixel * gfxbuffer = NULL;
+static vga_pixel * gfxalloc = NULL;         // gfxbuffer with the scroll pad around it
 //static uint32_t dstbuffer __attribute__((aligned(32)));
 
 // Visible buffer
 
+// Overlay plane (setCursor, setOverlay): merged at scan out in 2 line buffers,
+// the line after the current one is prepared while the current one is sent
+static vga_pixel * ovl_buf = NULL;
+static int ovl_stride = 0;                  // pixels per line buffer
+static int ovl_pad = 0;                     // scroll pad before line buffer 0
+static volatile int ovl_y[2] = {-1, -1};    // frame buffer line held by each line buffer
+static int ovl_left = 0;
+static int ovl_width = 0;
+static const vga_pixel * cursor_img = NULL;
+static int cursor_stride = 0;               // pixels per image row (w given to setCursor)
+static int cursor_w = 0;                    // shown part, up to CURSOR_MAX
+static int cursor_h = 0;
+static int cursor_hotx = 0;
+static int cursor_hoty = 0;
+static volatile uint32_t cursor_pos = 0;    // top left, y << 16 | x (16 bits each), one write per move
+static VGA_T4::Surface osd;
+static bool osd_on = false;
+static bool osd_key = false;
+
+// Copper list (copperBegin...copperCommit): the app builds one list while the ISR runs the other,
+// they swap at the start of the frame after copperCommit
+// Letterbox (begin with a height): the lines above and below the frame buffer all come from one line
+static vga_pixel * blank_line = NULL;
+static vga_pixel letterbox_color = 0;
+
+static VGA_T4::CopperOp copper[2][COPPER_MAX];
+static int copper_count[2] = {0, 0};
+static volatile int copper_front = 0;       // list run by the ISR
+static volatile int copper_pending = -1;    // list to run from the next frame
+static int copper_idx = 0;                  // next entry of the front list
+static vga_pixel * copper_src = NULL;       // BASE/LINE source, NULL for the frame buffer
+static int copper_from = 0;                 // line of the BASE/LINE entry
+static int copper_step = 0;                 // fb_stride for BASE, 0 for LINE
+static int copper_dx = 0;
+static vga_pixel * line_src[2] = {NULL, NULL};  // copper source of the next 2 lines
+static int line_dx[2] = {0, 0};
+
 
 #ifdef DEBUG
 static uint32_t   ISRTicks_prev = 0;
@@ -66,9 +105,13 @@ DMAChannel VGA_T4::VGA_Handler::flexio1DMA = false;
 DMAChannel VGA_T4::VGA_Handler::flexio2DMA = false;
 
 int  VGA_T4::VGA_Handler::fb_height =0;
+int  VGA_T4::VGA_Handler::fb_top =0;
+int  VGA_T4::VGA_Handler::scan_height =0;
 int  VGA_T4::VGA_Handler::fb_stride =0;
 int  VGA_T4::VGA_Handler::line_double =0;
 int  VGA_T4::VGA_Handler::pix_shift =0;
+vga_pixel * VGA_T4::VGA_Handler::line_ring = NULL;
+int  VGA_T4::VGA_Handler::line_ring_mask =0;
 
 
 
@@ -76,6 +119,100 @@ PolyDef	PolySet;  // will contain a polygon data
 
 //absoluteley necessary for callback functions of ISR
 
+// pixels of the copper scroll pad, left_border rounded to a cache line
+static inline int scroll_pad(int left) {
+  return ((left*sizeof(vga_pixel) + 31) & ~31) / sizeof(vga_pixel);
+}
+
+// line y as scanned out without overlay
+static inline vga_pixel * scan_line(uint32_t y) {
+  if (VGA_T4::VGA_Handler::line_ring != NULL) {
+    return &VGA_T4::VGA_Handler::line_ring[VGA_T4::VGA_Handler::fb_stride*(y & VGA_T4::VGA_Handler::line_ring_mask)];
+  }
+  if (gfxbuffer != NULL) return &gfxbuffer[VGA_T4::VGA_Handler::fb_stride*y];
+  return NULL;
+}
+
+// line y as scanned out, with the copper source
+static inline vga_pixel * source_line(uint32_t y) {
+  vga_pixel * src = line_src[y & 1];
+  return (src != NULL) ? src : scan_line(y);
+}
+
+// run the copper entries up to line y, y goes 0,1,2... within a frame
+FASTRUN static void copper_line(int y) {
+  if (y == 0) {
+    if (copper_pending >= 0) {
+      copper_front = copper_pending;
+      copper_pending = -1;
+    }
+    copper_idx = 0;
+    copper_src = NULL;
+    copper_dx = 0;
+  }
+  const VGA_T4::CopperOp * op = &copper[copper_front][copper_idx];
+  int count = copper_count[copper_front];
+  while ( (copper_idx < count) && (op->line <= y) ) {
+    switch (op->op) {
+      case copper_op_t::COPPER_BASE:
+        copper_src = op->pixels;
+        copper_step = VGA_T4::VGA_Handler::fb_stride;
+        copper_from = op->line;
+        break;
+      case copper_op_t::COPPER_LINE:
+        copper_src = op->pixels;
+        copper_step = 0;
+        copper_from = op->line;
+        break;
+      case copper_op_t::COPPER_SCROLL:
+        copper_dx = op->value;
+        break;
+    }
+    copper_idx++;
+    op++;
+  }
+  line_src[y & 1] = (copper_src != NULL) ? &copper_src[(y - copper_from)*copper_step] : NULL;
+  line_dx[y & 1] = copper_dx;
+}
+
+// copy of line y with the OSD and cursor pixels over it, if they cross it
+FASTRUN static void overlay_line(int y) {
+  int b = y & 1;
+  ovl_y[b] = -1;
+  uint32_t pos = cursor_pos;
+  int cx = (int16_t)(pos & 0xffff);
+  int cy = (int16_t)(pos >> 16);
+  bool on_cursor = (cursor_img != NULL) && (y >= cy) && (y < cy + cursor_h);
+  bool on_osd = osd_on && (y >= osd.y) && (y < osd.y + osd.height);
+  if (!on_cursor && !on_osd) return;
+  vga_pixel * src = source_line(y);
+  if (src == NULL) return;
+
+  vga_pixel * line = &ovl_buf[ovl_pad + b*ovl_stride];
+  memcpy((void*)line, (void*)src, VGA_T4::VGA_Handler::fb_stride*sizeof(vga_pixel)+4);
+  vga_pixel * dst = &line[ovl_left + line_dx[b]];   // the overlay does not scroll
+  if (on_osd) {
+    const vga_pixel * s = &osd.pixels[(y - osd.y)*osd.stride];
+    int x1 = (osd.x < 0) ? -osd.x : 0;
+    int x2 = ((osd.x + osd.width) > ovl_width) ? ovl_width - osd.x : osd.width;
+    for (int i=x1; i<x2; i++)
+    {
+      if ( (!osd_key) || (s[i] != 0) ) dst[osd.x + i] = s[i];
+    }
+  }
+  if (on_cursor) {
+    const vga_pixel * s = &cursor_img[(y - cy)*cursor_stride];
+    int x1 = (cx < 0) ? -cx : 0;
+    int x2 = ((cx + cursor_w) > ovl_width) ? ovl_width - cx : cursor_w;
+    for (int i=x1; i<x2; i++)
+    {
+      if (s[i] != 0) dst[cx + i] = s[i];
+    }
+  }
+  arm_dcache_flush_delete((void*)line, ovl_stride*sizeof(vga_pixel));
+  ovl_y[b] = y;
+}
+
 FASTRUN void QT3_isr() {
   TMR3_SCTRL3 &= ~(TMR_SCTRL_TCF);
   TMR3_CSCTRL3 &= ~(TMR_CSCTRL_TCF1|TMR_CSCTRL_TCF2);
@@ -95,32 +232,49 @@ FASTRUN void QT3_isr() {
   currentLine = currentLine % 525;
 
 
-  uint32_t y = (currentLine - TOP_BORDER) >> VGA_T4::VGA_Handler::line_double;
+  uint32_t s = (currentLine - TOP_BORDER) >> VGA_T4::VGA_Handler::line_double;
+  uint32_t y = s - VGA_T4::VGA_Handler::fb_top;
   // Visible area  
-  if (y >= 0 && y < VGA_T4::VGA_Handler::fb_height) {
+  if (s < (uint32_t)VGA_T4::VGA_Handler::scan_height) {
     // Disable DMAs
     //DMA_CERQ = flexio2DMA.channel;
     //DMA_CERQ = flexio1DMA.channel; 
 
-    // Setup src adress
-    // Aligned 32 bits copy
-    unsigned long * p=(uint32_t *)&gfxbuffer[VGA_T4::VGA_Handler::fb_stride*y];
-    VGA_T4::VGA_Handler::flexio2DMA.TCD->SADDR = p;
-    if (VGA_T4::VGA_Handler::pix_shift & DMA_HACK)
-    {
-      // Unaligned copy
-      uint8_t * p2=(uint8_t *)&gfxbuffer[VGA_T4::VGA_Handler::fb_stride*y+(VGA_T4::VGA_Handler::pix_shift&0xf)];
-      VGA_T4::VGA_Handler::flexio1DMA.TCD->SADDR = p2;
-    }
-    else  {
-      p=(uint32_t *)&gfxbuffer[VGA_T4::VGA_Handler::fb_stride*y+(VGA_T4::VGA_Handler::pix_shift&0xc)]; // multiple of 4
-      VGA_T4::VGA_Handler::flexio1DMA.TCD->SADDR = p;
+    // Line source: overlay line buffer, ring of composed lines or frame buffer,
+    // moved by the copper scroll (whole 32 bits words, the address stays aligned)
+    vga_pixel * line;
+    if (y >= (uint32_t)VGA_T4::VGA_Handler::fb_height) line = blank_line;
+    else if (ovl_y[y & 1] == (int)y) line = &ovl_buf[ovl_pad + (y & 1)*ovl_stride] + line_dx[y & 1];
+    else if ((line = source_line(y)) != NULL) line += line_dx[y & 1];
+
+    if (line != NULL) {
+      // Setup src adress
+      // Aligned 32 bits copy
+      unsigned long * p=(uint32_t *)line;
+      VGA_T4::VGA_Handler::flexio2DMA.TCD->SADDR = p;
+      if (VGA_T4::VGA_Handler::pix_shift & DMA_HACK)
+      {
+        // Unaligned copy
+        uint8_t * p2=(uint8_t *)&line[(VGA_T4::VGA_Handler::pix_shift&0xf)];
+        VGA_T4::VGA_Handler::flexio1DMA.TCD->SADDR = p2;
+      }
+      else  {
+        p=(uint32_t *)&line[(VGA_T4::VGA_Handler::pix_shift&0xc)]; // multiple of 4
+        VGA_T4::VGA_Handler::flexio1DMA.TCD->SADDR = p;
+      }
+
+      // Enable DMAs
+      DMA_SERQ = VGA_T4::VGA_Handler::flexio2DMA.channel;
+      DMA_SERQ = VGA_T4::VGA_Handler::flexio1DMA.channel;
+      arm_dcache_flush_delete((void*)((uint32_t *)line), VGA_T4::VGA_Handler::fb_stride);
     }
+  }
 
-    // Enable DMAs
-    DMA_SERQ = VGA_T4::VGA_Handler::flexio2DMA.channel;
-    DMA_SERQ = VGA_T4::VGA_Handler::flexio1DMA.channel;
-    arm_dcache_flush_delete((void*)((uint32_t *)&gfxbuffer[VGA_T4::VGA_Handler::fb_stride*y]), VGA_T4::VGA_Handler::fb_stride);
+  // copper and overlay of the next line, once per frame buffer line
+  uint32_t next = ((currentLine + 1 - TOP_BORDER) >> VGA_T4::VGA_Handler::line_double) - VGA_T4::VGA_Handler::fb_top;
+  if ( (next < (uint32_t)VGA_T4::VGA_Handler::fb_height) && (next != y) ) {
+    copper_line(next);
+    if (ovl_buf != NULL) overlay_line(next);
   }
   sei();  
 
@@ -167,7 +321,7 @@ void VGA_T4::VGA_Handler::tweak_video(int shiftdelta, int numdelta, int denomdel
 }
 
 // display VGA image
-vga_error_t VGA_T4::VGA_Handler::begin(vga_mode_t mode)
+vga_error_t VGA_T4::VGA_Handler::begin(vga_mode_t mode, bool withfb, int height)
 {
   uint32_t flexio_clock_div = 0;
   combine_shiftreg = 0;
@@ -281,6 +435,17 @@ vga_error_t VGA_T4::VGA_Handler::begin(vga_mode_t mode)
       }
   }	
 
+  // letterbox: frame buffer of height lines centered in the mode lines
+  scan_height = fb_height;
+  fb_top = 0;
+  if ( (height > 0) && (height < fb_height) ) {
+    fb_top = (fb_height - height)/2;
+    fb_height = height;
+    if (blank_line == NULL) blank_line = (vga_pixel*)vga_alloc((fb_stride+4)*sizeof(vga_pixel), FB_REGION);
+    if (blank_line == NULL) return(vga_error_t::VGA_ERROR);
+    setLetterboxColor(letterbox_color);
+  }
+
   // Save param for tweek adjustment
   ref_div_select = div_select;
   ref_freq_num = num;
@@ -597,11 +762,20 @@ vga_error_t VGA_T4::VGA_Handler::begin(vga_mode_t mode)
 #endif
 
   /* initialize gfx buffer */
-  if (gfxbuffer == NULL) gfxbuffer = (vga_pixel*)malloc(fb_stride*fb_height*sizeof(vga_pixel)+4); // 4bytes for pixel shift
-  if (gfxbuffer == NULL) return(vga_error_t::VGA_ERROR);
+  if (!withfb) {
+    framebuffer = NULL;
+    resetTarget();
+    return(vga_error_t::VGA_OK);
+  }
+  // scroll pad on both sides: the copper scroll moves the reads of the first and last lines out by up to left_border
+  int pad = scrollPad();
+  if (gfxalloc == NULL) gfxalloc = (vga_pixel*)vga_alloc((fb_stride*fb_height + 2*pad)*sizeof(vga_pixel)+4, FB_REGION); // 4bytes for pixel shift
+  if (gfxalloc == NULL) return(vga_error_t::VGA_ERROR);
 
-  memset((void*)&gfxbuffer[0],0, fb_stride*fb_height*sizeof(vga_pixel)+4);
+  memset((void*)&gfxalloc[0],0, (fb_stride*fb_height + 2*pad)*sizeof(vga_pixel)+4);
+  gfxbuffer = &gfxalloc[pad];
   framebuffer = (vga_pixel*)&gfxbuffer[left_border];
+  resetTarget();
 
   return(vga_error_t::VGA_OK);
 }
@@ -620,7 +794,19 @@ void VGA_T4::VGA_Handler::end()
   CCM_CCGR6 &= ~0xC0000000;
   sei(); 
   delay(50);
-  if (gfxbuffer != NULL) free(gfxbuffer); 
+  vga_free(gfxalloc, FB_REGION);
+  gfxalloc = NULL;
+  gfxbuffer = NULL;
+  vga_free(blank_line, FB_REGION);
+  blank_line = NULL;
+  cursor_img = NULL;
+  osd_on = false;
+  ovl_y[0] = -1;
+  ovl_y[1] = -1;
+  vga_free(ovl_buf, FB_REGION);
+  ovl_buf = NULL;
+  copperBegin();
+  copperCommit();
 }
 
 void debug()
@@ -640,6 +826,15 @@ void VGA_T4::VGA_Handler::get_frame_buffer_size(int *width, int *height)
   *height = fb_height;
 }
 
+void VGA_T4::VGA_Handler::setLetterboxColor(vga_pixel color)
+{
+  letterbox_color = color;
+  if (blank_line == NULL) return;
+  memset((void*)blank_line, 0, (fb_stride+4)*sizeof(vga_pixel));
+  for (int i=0; i<fb_width; i++) blank_line[left_border+i] = color;
+  arm_dcache_flush_delete((void*)blank_line, (fb_stride+4)*sizeof(vga_pixel));
+}
+
 void VGA_T4::VGA_Handler::waitSync()
 {
   while (VSYNC == 0) {};
@@ -650,12 +845,172 @@ void VGA_T4::VGA_Handler::waitLine(int line)
   while (currentLine != (unsigned int)line) {};
 }
 
+int VGA_T4::VGA_Handler::getLine()
+{
+  return currentLine;
+}
+
+int VGA_T4::VGA_Handler::scrollPad()
+{
+  return scroll_pad(left_border);
+}
+
+void VGA_T4::VGA_Handler::setLineRing(vga_pixel *buffer, int nblines)
+{
+  cli();
+  line_ring_mask = nblines - 1;
+  line_ring = buffer;
+  sei();
+}
+
+// line buffers of the overlay for the current mode
+static bool overlay_buffers(int width, int left) {
+  if (ovl_buf == NULL) {
+    ovl_stride = (VGA_T4::VGA_Handler::fb_stride + 4 + 31) & ~31;
+    ovl_pad = scroll_pad(left);
+    ovl_buf = (vga_pixel*)vga_alloc((2*ovl_stride + 2*ovl_pad)*sizeof(vga_pixel), FB_REGION);
+    if (ovl_buf == NULL) return false;
+  }
+  ovl_width = width;
+  ovl_left = left;
+  return true;
+}
+
+void VGA_T4::VGA_Handler::setCursor(const vga_pixel *image, int w, int h, int hotx, int hoty)
+{
+  cli();
+  cursor_img = NULL;
+  ovl_y[0] = -1;
+  ovl_y[1] = -1;
+  sei();
+  if ( (image == NULL) || (w <= 0) || (h <= 0) || (!overlay_buffers(fb_width, left_border)) ) return;
+  cursor_stride = w;
+  cursor_w = (w > CURSOR_MAX) ? CURSOR_MAX : w;
+  cursor_h = (h > CURSOR_MAX) ? CURSOR_MAX : h;
+  cursor_hotx = hotx;
+  cursor_hoty = hoty;
+  cursor_img = image;
+}
+
+void VGA_T4::VGA_Handler::moveCursor(int x, int y)
+{
+  cursor_pos = ((uint32_t)(uint16_t)(y - cursor_hoty) << 16) | (uint16_t)(x - cursor_hotx);
+}
+
+void VGA_T4::VGA_Handler::setOverlay(const Surface *surface, bool transparent)
+{
+  cli();
+  osd_on = false;
+  ovl_y[0] = -1;
+  ovl_y[1] = -1;
+  sei();
+  if ( (surface == NULL) || (!overlay_buffers(fb_width, left_border)) ) return;
+  osd = *surface;
+  osd_key = transparent;
+  osd_on = true;
+}
+
+// list built by the copper calls: the one the ISR neither runs nor will run
+static int copper_back() {
+  return (copper_front == 0) ? 1 : 0;
+}
+
+// keeps the list sorted by line, entries of the same line in the order they were added
+static void copper_add(int line, copper_op_t op, vga_pixel *pixels, int value) {
+  int b = copper_back();
+  int n = copper_count[b];
+  if ( (n >= COPPER_MAX) || (line < 0) ) return;
+  VGA_T4::CopperOp * list = copper[b];
+  while ( (n > 0) && (list[n-1].line > line) ) {
+    list[n] = list[n-1];
+    n--;
+  }
+  list[n].line = line;
+  list[n].op = op;
+  list[n].pixels = pixels;
+  list[n].value = value;
+  copper_count[b]++;
+}
+
+void VGA_T4::VGA_Handler::copperBegin()
+{
+  // a committed list not started yet is given back
+  cli();
+  copper_pending = -1;
+  sei();
+  copper_count[copper_back()] = 0;
+}
+
+void VGA_T4::VGA_Handler::copperBase(int line, vga_pixel *buffer)
+{
+  if (buffer == NULL) {
+    copper_add(line, copper_op_t::COPPER_BASE, NULL, 0);
+    return;
+  }
+  // the frame buffer line at line shows line 0 of buffer
+  copper_add(line, copper_op_t::COPPER_BASE, buffer - left_border, 0);
+}
+
+void VGA_T4::VGA_Handler::copperLine(int line, vga_pixel *pixels)
+{
+  if (pixels == NULL) return;
+  copper_add(line, copper_op_t::COPPER_LINE, pixels - left_border, 0);
+}
+
+void VGA_T4::VGA_Handler::copperScroll(int line, int dx)
+{
+  if (dx > left_border) dx = left_border;
+  if (dx < -left_border) dx = -left_border;
+  // whole 32 bits words, the DMA reads the line from an aligned address
+  dx -= dx % (int)(sizeof(uint32_t)/sizeof(vga_pixel));
+  copper_add(line, copper_op_t::COPPER_SCROLL, NULL, dx);
+}
+
+void VGA_T4::VGA_Handler::copperCommit()
+{
+  copper_pending = copper_back();
+}
+
+void VGA_T4::VGA_Handler::setTarget(vga_pixel *buffer, int stride, int x, int y, int w, int h)
+{
+  Surface surface = { buffer, w, h, stride, x, y };
+  setTarget(surface);
+}
+
+void VGA_T4::VGA_Handler::setTarget(const Surface &surface)
+{
+  target_surface = surface;
+  // biased so that primitives keep addressing target[y*stride+x] in screen coordinates
+  target = surface.pixels - (surface.y*surface.stride + surface.x);
+  target_stride = surface.stride;
+  clip_x1 = surface.x;
+  clip_y1 = surface.y;
+  clip_x2 = surface.x + surface.width;
+  clip_y2 = surface.y + surface.height;
+}
+
+VGA_T4::Surface VGA_T4::VGA_Handler::getTarget()
+{
+  return target_surface;
+}
+
+VGA_T4::Surface VGA_T4::VGA_Handler::screen()
+{
+  Surface surface = { framebuffer, fb_width, fb_height, fb_stride, 0, 0 };
+  return surface;
+}
+
+void VGA_T4::VGA_Handler::resetTarget()
+{
+  setTarget(screen());
+}
+
 void VGA_T4::VGA_Handler::clear(vga_pixel color) {
   int i,j;
-  for (j=0; j<fb_height; j++)
+  for (j=clip_y1; j<clip_y2; j++)
   {
-    vga_pixel * dst=&framebuffer[j*fb_stride];
-    for (i=0; i<fb_width; i++)
+    vga_pixel * dst=&target[j*target_stride+clip_x1];
+    for (i=clip_x1; i<clip_x2; i++)
     {
       *dst++ = color;
     }
@@ -664,12 +1019,12 @@ void VGA_T4::VGA_Handler::clear(vga_pixel color) {
 
 
 void VGA_T4::VGA_Handler::drawPixel(int x, int y, vga_pixel color){
-	if((x>=0) && (x<=fb_width) && (y>=0) && (y<=fb_height))
-		framebuffer[y*fb_stride+x] = color;
+	if((x>=clip_x1) && (x<clip_x2) && (y>=clip_y1) && (y<clip_y2))
+		target[y*target_stride+x] = color;
 }
 
 vga_pixel VGA_T4::VGA_Handler::getPixel(int x, int y){
-  return(framebuffer[y*fb_stride+x]);
+  return(target[y*target_stride+x]);
 }
 
 vga_pixel * VGA_T4::VGA_Handler::getLineBuffer(int j) {
@@ -677,15 +1032,18 @@ vga_pixel * VGA_T4::VGA_Handler::getLineBuffer(int j) {
 }
 
 void VGA_T4::VGA_Handler::drawRect(int16_t x, int16_t y, int16_t w, int16_t h, vga_pixel color) {
-  int i,j,l=y;
-  for (j=0; j<h; j++)
+  int x1 = (x < clip_x1) ? clip_x1 : x;
+  int y1 = (y < clip_y1) ? clip_y1 : y;
+  int x2 = ((x+w) > clip_x2) ? clip_x2 : x+w;
+  int y2 = ((y+h) > clip_y2) ? clip_y2 : y+h;
+  int i,j;
+  for (j=y1; j<y2; j++)
   {
-    vga_pixel * dst=&framebuffer[l*fb_stride+x];
-    for (i=0; i<w; i++)
+    vga_pixel * dst=&target[j*target_stride+x1];
+    for (i=x1; i<x2; i++)
     {
       *dst++ = color;
     }
-    l++;
   }
 }
 
@@ -693,15 +1051,34 @@ void VGA_T4::VGA_Handler::drawText(int16_t x, int16_t y, const char * text, vga_
   vga_pixel c;
   vga_pixel * dst;
   
+  int charh = doublesize ? 16 : 8;
   while ((c = *text++)) {
     const unsigned char * charpt=&font8x8[c][0];
 
+    if ( (x >= clip_x2) || ((x+8) <= clip_x1) || (y >= clip_y2) || ((y+charh) <= clip_y1) ) {
+      x +=8;
+      continue;
+    }
+    if ( (x < clip_x1) || ((x+8) > clip_x2) || (y < clip_y1) || ((y+charh) > clip_y2) ) {
+      // partly visible: pixel by pixel
+      for (int i=0;i<charh;i++)
+      {
+        unsigned char bits = charpt[doublesize ? (i>>1) : i];
+        for (int b=0;b<8;b++)
+        {
+          drawPixel(x+b, y+i, ((bits>>b)&0x01) ? fgcolor : bgcolor);
+        }
+      }
+      x +=8;
+      continue;
+    }
+
     int l=y;
     for (int i=0;i<8;i++)
     {     
       unsigned char bits;
       if (doublesize) {
-        dst=&framebuffer[l*fb_stride+x];
+        dst=&target[l*target_stride+x];
         bits = *charpt;     
         if (bits&0x01) *dst++=fgcolor;
         else *dst++=bgcolor;
@@ -728,7 +1105,7 @@ void VGA_T4::VGA_Handler::drawText(int16_t x, int16_t y, const char * text, vga_
         else *dst++=bgcolor;
         l++;
       }
-      dst=&framebuffer[l*fb_stride+x]; 
+      dst=&target[l*target_stride+x]; 
       bits = *charpt++;     
       if (bits&0x01) *dst++=fgcolor;
       else *dst++=bgcolor;
@@ -773,12 +1150,14 @@ void VGA_T4::VGA_Handler::drawSprite(int16_t x, int16_t y, const int16_t *bitmap
   int h = *bitmap++;
 
 
+  int wx, wy, ww, wh;
+
   if ( (arw == 0) || (arh == 0) ) {
     // no crop window
-    arx = x;
-    ary = y;
-    arw = w;
-    arh = h;
+    wx = x;
+    wy = y;
+    ww = w;
+    wh = h;
   }
   else {
     if ( (x>(arx+arw)) || ((x+w)<arx) || (y>(ary+arh)) || ((y+h)<ary)   ) {
@@ -804,16 +1183,34 @@ void VGA_T4::VGA_Handler::drawSprite(int16_t x, int16_t y, const int16_t *bitmap
     if ( ((y+h) > ary) && ((y+h)<(ary+arh)) ) {
       arh -= (ary+arh-y-h);
     }     
+    wx = arx;
+    wy = ary;
+    ww = arw;
+    wh = arh;
   }
 
+  // clip the window to the drawing target
+  if (wx < clip_x1) {
+    bmp_offx += clip_x1 - wx;
+    ww -= clip_x1 - wx;
+    wx = clip_x1;
+  }
+  if (wy < clip_y1) {
+    bmp_offy += clip_y1 - wy;
+    wh -= clip_y1 - wy;
+    wy = clip_y1;
+  }
+  if ((wx + ww) > clip_x2) ww = clip_x2 - wx;
+  if ((wy + wh) > clip_y2) wh = clip_y2 - wy;
+  if ((ww <= 0) || (wh <= 0)) return;
    
-  int l=ary;
+  int l=wy;
   bitmap = bitmap + bmp_offy*w + bmp_offx;
-  for (int row=0;row<arh; row++)
+  for (int row=0;row<wh; row++)
   {
-    vga_pixel * dst=&framebuffer[l*fb_stride+arx];  
+    vga_pixel * dst=&target[l*target_stride+wx];  
     bmp_ptr = (int16_t *)bitmap;
-    for (int col=0;col<arw; col++)
+    for (int col=0;col<ww; col++)
     {
         uint16_t pix= *bmp_ptr++;
         *dst++ = VGA_RGB(R16(pix),G16(pix),B16(pix));
@@ -1126,7 +1523,7 @@ static uint16_t sampleBufferSize = 0;
 
 static void (*fillsamples)(short * stream, int len) = nullptr;
 
-static uint32_t * i2s_tx_buffer __attribute__((aligned(32)));
+static uint32_t * i2s_tx_buffer = NULL;
 static uint16_t * i2s_tx_buffer16;
 static uint16_t * txreg = (uint16_t *)((uint32_t)&I2S1_TDR0 + 2);
 
@@ -1176,7 +1573,7 @@ FASTRUN void SOFTWARE_isr() {
 FLASHMEM void VGA_T4::VGA_Handler::begin_audio(int samplesize, void (*callback)(short * stream, int len))
 {
   fillsamples = callback;
-  i2s_tx_buffer =  (uint32_t*)malloc(samplesize*sizeof(uint32_t)); //&i2s_tx[0];
+  i2s_tx_buffer =  (uint32_t*)vga_alloc(samplesize*sizeof(uint32_t), AUDIO_REGION); //&i2s_tx[0];
 
   if (i2s_tx_buffer == NULL) {
     Serial.println("could not allocate audio samples");
@@ -1204,8 +1601,7 @@ FLASHMEM void VGA_T4::VGA_Handler::begin_audio(int samplesize, void (*callback)(
 }
  
 FLASHMEM void VGA_T4::VGA_Handler::end_audio() {
-  if (i2s_tx_buffer != NULL) {
-  	free(i2s_tx_buffer);
-  }
+  vga_free(i2s_tx_buffer, AUDIO_REGION);
+  i2s_tx_buffer = NULL;
 }
 